@@ -43,18 +43,45 @@
    THE POSSIBILITY OF SUCH DAMAGE.
 */
 
-#include <fstream>
 #include <iostream>
 #include <list>
 #include <string>
 #include <vector>
 #include <queue>
+#include <set>
+#include <map>
+#include <algorithm>
 #include <limits>
+#include <ctime>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <future>
 
 #include <cstring>
 
 #include "pole.h"
 
+#ifdef POLE_WIN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
 #ifdef POLE_USE_UTF16_FILENAMES
 #include <codecvt>
 #endif //POLE_USE_UTF16_FILENAMES
@@ -62,6 +89,17 @@
 // enable to activate debugging output
 // #define POLE_DEBUG
 #define CACHEBUFSIZE 4096 //a presumably reasonable size for the read cache
+#define WRITEBUFSIZE 65536 //size of the write-back buffer of a stream, a multiple of any sector size
+#define IMPORTCHUNKSIZE 1048576 //bytes of host files read at a time by importTree
+#define IMPORTCHUNKS 8 //chunks in flight between reading and writing in importTree
+#define ARENAMINBLOCKS 16 //least big blocks reserved for a stream at once, see StreamIO::growChain
+#define ARENABYTES 1048576 //most bytes of big blocks reserved for a stream at once
+#define PREALLOCMIN 1048576 //least disk space reserved at once when the file grows, see StorageIO::reserveSpace
+#define PREALLOCMAX 268435456 //most disk space reserved at once when the file grows
+#define IOTHREADS 8 //threads running asynchronous operations, see IoExecutor
+#define LOADTHREADS 8 //most threads reading the allocation tables or directory, see Storage::ParallelLoad
+#define LOADMINBLOCKS 64 //least sectors read by each of them
+#define WALKBATCH 16 //streams visited per task of Storage::forEachStream, the unit of stealing
 
 namespace POLE
 {
@@ -72,6 +110,7 @@ class Header
     unsigned char id[8];       // signature, or magic identifier
     uint64 b_shift;          // bbat->blockSize = 1 << b_shift
     uint64 s_shift;          // sbat->blockSize = 1 << s_shift
+    uint64 num_dirent;       // sectors in the directory chain, version 4 only
     uint64 num_bat;          // blocks allocated for big bat
     uint64 dirent_start;     // starting block for directory info
     uint64 threshold;        // switch from small to big file (usually 4K)
@@ -89,6 +128,26 @@ class Header
     void debug();
 };
 
+// Counts what a storage does at the file level, see Storage::ioStats(). Any thread
+// adds to the counters, without locks.
+class IoCounters
+{
+  public:
+    enum { Reads, Writes, BytesRead, BytesWritten, Seeks, SectorsRead, SectorsWritten,
+      MiniSectorsRead, CacheHits, CacheMisses, ChainFollows, ChainLinks, Flushes,
+      BytesDelivered, Count };
+    IoCounters();
+    void add( int counter, uint64 n = 1 );
+    uint64 get( int counter );
+    void reset();
+    void access( uint64 pos, uint64 len );
+  private:
+    std::atomic<uint64> value[Count];
+    std::atomic<uint64> lastEnd;   // where the last read or write of the file ended
+    IoCounters( const IoCounters& );
+    IoCounters& operator=( const IoCounters& );
+};
+
 class AllocTable
 {
   public:
@@ -97,6 +156,7 @@ class AllocTable
     static const uint64 Bat;
     static const uint64 MetaBat;
     uint64 blockSize;
+    IoCounters* counters;      // where follow() is counted, if anywhere
     AllocTable();
     void clear();
     uint64 count();
@@ -105,20 +165,27 @@ class AllocTable
     void preserve( uint64 n );
     void set( uint64 index, uint64 val );
     unsigned unused();
+    uint64 unusedAfter( uint64 n );
     void setChain( std::vector<uint64> );
     std::vector<uint64> follow( uint64 start );
     uint64 operator[](uint64 index );
-    void load( const unsigned char* buffer, uint64 len );
+    void load( const unsigned char* buffer, uint64 first, uint64 n );
     void save( unsigned char* buffer );
     uint64 size();
     void debug();
     bool isDirty();
     void markAsDirty(uint64 dataIndex, int64 bigBlockSize);
     void flush(std::vector<uint64> blocks, StorageIO *const io, int64 bigBlockSize);
+    bool isDirtyBlock(uint64 blockIdx);
+    void freeze();
+    void keep(const std::vector<char>& blocks);
+    const std::vector<char>& frozenBlocks();
+    bool isFrozen(uint64 index);
   private:
     std::vector<uint64> data;
-    std::vector<uint64> dirtyBlocks;
-    bool bMaybeFragmented;
+    std::set<uint64> dirtyBlocks;
+    uint64 firstFree;          // no block below this index is available
+    std::vector<char> frozen;  // non-zero for blocks in use at the last commit, never handed out by unused()
     AllocTable( const AllocTable& );
     AllocTable& operator=( const AllocTable& );
 };
@@ -126,18 +193,16 @@ class AllocTable
 class DirEntry
 {
   public:
-    DirEntry(): valid(), name(), dir(), size(), start(), prev(), next(), child() {}
+    DirEntry(): size(), start(), prev(), next(), child(), name(), nameLength(), valid(), dir() {}
+    uint64 size;         // size (not valid if directory)
+    uint32 start;        // starting block
+    uint32 prev;         // previous sibling
+    uint32 next;         // next sibling
+    uint32 child;        // first child
+    uint32 name;         // offset of the compare key and the name in the arena of the owning DirTree
+    uint16 nameLength;   // length of the name in UTF-16 code units, precomputed for compare
     bool valid;          // false if invalid (should be skipped)
-    std::string name;    // the name, not in unicode anymore 
     bool dir;            // true if directory   
-    uint64 size;         // size (not valid if directory)
-    uint64 start;        // starting block
-    uint64 prev;         // previous sibling
-    uint64 next;         // next sibling
-    uint64 child;        // first child
-    int compare(const DirEntry& de);
-    int compare(const std::string& name2);
-
 };
 
 class DirTree
@@ -146,29 +211,59 @@ class DirTree
     static const uint64 End;
     DirTree(int64 bigBlockSize);
     void clear(int64 bigBlockSize);
+    void setWideSizes( bool wide );
     inline uint64 entryCount();
     uint64 unusedEntryCount();
     DirEntry* entry( uint64 index );
+    DirEntry* entry( uint64 index, uint32 generation );
+    uint32 generation( uint64 index );
+    std::vector<uint32> nextGenerations();
+    void setGenerations( const std::vector<uint32>& gens );
     DirEntry* entry( const std::string& name, bool create = false, int64 bigBlockSize = 0, StorageIO *const io = 0, int64 streamSize = 0);
     int64 indexOf( DirEntry* e );
     int64 parent( uint64 index );
     std::string fullName( uint64 index );
+    std::string name( const DirEntry* e );
+    void setName( DirEntry* e, const std::string& name );
+    int compare( const DirEntry* e, const DirEntry* e2 );
+    int compare( const DirEntry* e, const unsigned char* key2, uint64 len2 );
     std::vector<uint64> children( uint64 index );
     uint64 find_child( uint64 index, const std::string& name, uint64 &closest );
     void load( unsigned char* buffer, uint64 len );
+    void loadLazily( StorageIO *const io, const std::vector<uint64>& blocks, int64 bigBlockSize );
+    void loadAll();
     void save( unsigned char* buffer );
     uint64 size();
     void debug();
     bool isDirty();
+    bool isDirtyBlock(uint64 blockIdx);
     void markAsDirty(uint64 dataIndex, int64 bigBlockSize);
     void flush(std::vector<uint64> blocks, StorageIO *const io, int64 bigBlockSize, uint64 sb_start, uint64 sb_size);
     uint64 unused();
+    std::vector<uint64> createEntries( const std::vector<std::string>& names, const std::vector<uint64>& sizes, int64 bigBlockSize );
     void findParentAndSib(uint64 inIdx, const std::string& inFullName, uint64 &parentIdx, uint64 &sibIdx);
     uint64 findSib(uint64 inIdx, uint64 sibIdx);
-    void deleteEntry(DirEntry *entry, const std::string& inFullName, int64 bigBlockSize);
+    void deleteEntry(DirEntry *entry, uint64 parentIdx, int64 bigBlockSize);
   private:
     std::vector<DirEntry> entries;
-    std::vector<uint64> dirtyBlocks;
+    std::vector<unsigned char> arena; // names of all entries, back to back, referenced by DirEntry::name
+    std::set<uint64> dirtyBlocks;
+    StorageIO* lazyIo;              // set while some sectors of the directory are not decoded yet
+    std::vector<uint64> lazyBlocks; // sectors of the directory chain, for lazy loading
+    std::vector<char> lazyLoaded;   // non-zero for each sector of lazyBlocks already decoded
+    uint64 lazyPerBlock;            // directory entries per sector
+    uint64 freeHint;                // no unused entry below this index
+    std::vector<uint32> generations; // bumped when an entry is deleted, see EntryHandle
+    std::vector<uint32> parents;    // parent of each entry, built on first use by parent()
+    bool wideSizes;                 // version 4: stream sizes have 64 bits, the high half at 0x7C
+    uint32 controlPrefixes;         // bit c is set if some name starts with control character c
+    void setParent( uint64 index, uint64 parentIdx );
+    uint64 findSibling( uint64 first, const std::string& name, uint64 &closest );
+    void loadBlock( uint64 blockIdx );
+    void loadEntry( const unsigned char* buffer, DirEntry& e );
+    void saveEntry( uint64 index, unsigned char* buffer );
+    void storeName( DirEntry* e, const unsigned char* utf16, uint64 len );
+    uint64 linkBalanced( const std::vector<uint64>& sorted, uint64 lo, uint64 hi, int64 bigBlockSize );
     DirTree( const DirTree& );
     DirTree& operator=( const DirTree& );
 };
@@ -178,10 +273,13 @@ class StorageIO
   public:
     Storage* storage;         // owner
     std::string filename;     // filename
-    std::fstream file;        // associated with above name
+    int fd;                   // descriptor of the file, see readAt and writeAt
     int64 result;               // result of operation
     bool opened;              // true if file is opened
-    uint64 filesize;   // size of the file
+    std::atomic<uint64> filesize;   // size of the file
+    std::atomic<bool> writeFailed;  // a write to the file went wrong since it was opened
+    std::atomic<uint64> reserved;   // disk space reserved for the file, at least its size
+    std::mutex reserveMutex;        // taken while more disk space is reserved
     bool writeable;           // true if the file can be modified
     
     Header* header;           // storage header 
@@ -193,29 +291,70 @@ class StorageIO
     std::vector<uint64> mbat_blocks; // blocks for doubly indirect indices to big blocks
     std::vector<uint64> mbat_data; // the additional indices to big blocks
     bool mbatDirty;           // If true, mbat_blocks need to be written
+    IoCounters counters;      // see Storage::ioStats()
+    bool transacted;          // changes reach the file only on commit()
+    int openFlags;            // flags given to open()
+    int flushPolicy;          // see Storage::setFlushPolicy()
+    uint64 flushAmount;
+    uint64 opsSinceFlush;     // changes since the last flush, for the policy
+    uint64 bytesSinceFlush;
+    time_t lastFlush;
        
-    std::list<Stream*> streams;
+    std::multimap<uint64, StreamIO*> streams; // open streams by entry, whose buffered writes go out on flush
+
+    // Snapshots, see snapshot(): each holds on to the big blocks in use at the commit
+    // it shows, which are kept from reuse as long as any snapshot refers to them.
+    std::shared_ptr<std::vector<char> > committed;          // of the last commit, once a snapshot asks
+    std::list<std::weak_ptr<std::vector<char> > > pinned;   // of earlier commits
+    std::shared_ptr<std::vector<char> > version;            // in a snapshot: the blocks it reads
+
+    // Different streams may be written by different threads at once. mutex guards
+    // the header, the tables and the directory, streamsMutex guards streams. They
+    // are taken in the order streamsMutex, mutex of a StreamIO, mutex, so whoever
+    // holds mutex must not call flush() or changed() or open a stream.
+    std::recursive_mutex mutex;
+    std::mutex streamsMutex;
 
     StorageIO( Storage* storage, const char* filename );
     ~StorageIO();
     
-    bool open(bool bWriteAccess = false, bool bCreate = false);
+    bool open(bool bWriteAccess = false, bool bCreate = false, int flags = 0, uint64 expectedSize = 0);
     void close();
     void flush();
-    void load(bool bWriteAccess);
-    void create();
+    void changed(uint64 bytes);
+    bool commit();
+    void revert();
+    void load(bool bWriteAccess, int flags = 0);
+    void loadTables(int flags);
+    void loadTable(AllocTable* table, const std::vector<uint64>& blocks, unsigned nthreads);
+    void loadDirectory(const std::vector<uint64>& blocks, int flags, unsigned nthreads);
+    void flushTables();
+    bool saveHeader();
+    void create(uint64 expectedSize);
     void init();
+    void reserveSpace(uint64 end);
+    void freezeBlocks();
+    bool snapshot(StorageIO* view);
+    void padFile(bool bRelease);
     bool deleteByName(const std::string& fullName);
 
-    bool deleteNode(DirEntry *entry, const std::string& fullName);
+    bool deleteEntry(DirEntry *entry, uint64 parentIdx);
+
+    bool deleteNode(DirEntry *entry, uint64 parentIdx);
+
+    bool deleteLeaf(DirEntry *entry, uint64 parentIdx);
 
-    bool deleteLeaf(DirEntry *entry, const std::string& fullName);
+    bool createEntries(const std::vector<std::string>& names, const std::vector<uint64>& sizes, std::vector<uint64>* indexes = 0);
 
+    bool importTree(const std::string& hostPath, const std::string& path);
+
+    uint64 readFile( uint64 pos, unsigned char* data, uint64 len );
+    uint64 writeFile( uint64 pos, const unsigned char* data, uint64 len );
     uint64 loadBigBlocks( std::vector<uint64> blocks, unsigned char* buffer, uint64 maxlen );
 
     uint64 loadBigBlock( uint64 block, unsigned char* buffer, uint64 maxlen );
 
-    uint64 saveBigBlocks( std::vector<uint64> blocks, uint64 offset, unsigned char* buffer, uint64 len );
+    uint64 saveBigBlocks( const std::vector<uint64>& blocks, uint64 offset, unsigned char* buffer, uint64 len, uint64 startAtBlock = 0 );
 
     uint64 saveBigBlock( uint64 block, uint64 offset, unsigned char*buffer, uint64 len );
 
@@ -223,12 +362,14 @@ class StorageIO
 
     uint64 loadSmallBlock( uint64 block, unsigned char* buffer, uint64 maxlen );
     
-    uint64 saveSmallBlocks( std::vector<uint64> blocks, uint64 offset, unsigned char* buffer, uint64 len, int64 startAtBlock = 0  );
+    uint64 saveSmallBlocks( const std::vector<uint64>& blocks, uint64 offset, unsigned char* buffer, uint64 len, int64 startAtBlock = 0  );
 
     uint64 saveSmallBlock( uint64 block, uint64 offset, unsigned char* buffer, uint64 len );
     
     StreamIO* streamIO( const std::string& name, bool bCreate = false, int64 streamSize = 0 ); 
 
+    StreamIO* streamIO( uint64 index );
+
     void flushbbat();
 
     void flushsbat();
@@ -237,6 +378,16 @@ class StorageIO
 
     uint64 ExtendFile( std::vector<uint64> *chain );
 
+    uint64 ExtendSmallFile( std::vector<uint64> *chain );
+
+    uint64 copyOnWrite( std::vector<uint64> *chain, uint64 k, bool bCopy );
+
+    void freeChain( AllocTable* table, const std::vector<uint64>& chain, uint64 from );
+
+    void reserveDirectory( uint64 nEntries );
+
+    void reserveBlocks( uint64 n, std::vector<uint64>& result );
+
     void addbbatBlock();
 
   private:  
@@ -255,7 +406,8 @@ class StreamIO
     bool eof;
     bool fail;
 
-    StreamIO( StorageIO* io, DirEntry* entry );
+    StreamIO( StorageIO* io, uint64 index );
+    StreamIO( StreamIO* source );
     ~StreamIO();
     uint64 size();
     void setSize(uint64 newSize);
@@ -267,9 +419,30 @@ class StreamIO
     uint64 write( unsigned char* data, uint64 len );
     uint64 write( uint64 pos, unsigned char* data, uint64 len );
     void flush();
+    void flushWrites();
+    void mergeWrites();
+    void dropWrites();
+    void reload();
 
   private:
-    std::vector<uint64> blocks;
+    // The chain may be shared with clones and other streams of the same entry, see
+    // ownChain(); it is never changed while shared.
+    std::shared_ptr<std::vector<uint64> > chain;
+    std::vector<uint64>& ownChain();
+
+    // A stream is used by one thread at a time, but flush() may come from any;
+    // reading takes no lock of the storage when it is read-only.
+    // Big blocks are taken from an arena of blocks reserved for the stream alone,
+    // so its data is written without the storage lock; they are linked into the
+    // allocation table by mergeWrites().
+    std::recursive_mutex mutex;
+    uint32 generation;           // of the entry when the stream was opened
+    uint64 entrySize;            // size when the stream was opened, which is kept if the storage is read-only
+    uint64 linked;               // blocks[0..linked-1] are linked in the allocation table
+    std::vector<uint64> arena;   // reserved big blocks, the next one last
+    uint64 arenaSize;            // big blocks to reserve next time
+    void growChain( uint64 n );
+    void linkBlocks();
 
     // no copy or assign
     StreamIO( const StreamIO& );
@@ -283,6 +456,92 @@ class StreamIO
     uint64 cache_size;
     uint64 cache_pos;
     void updateCache();
+
+    // write-back buffer, gathers small writes into runs of whole sectors;
+    // holds bytes wbuf_pos .. wbuf_pos+wbuf_size-1 of the stream
+    unsigned char* wbuf_data;
+    uint64 wbuf_size;
+    uint64 wbuf_pos;
+    uint64 writeBlocks( uint64 pos, unsigned char* data, uint64 len );
+};
+
+// a piece of a host file within an ImportChunk
+struct ImportPiece
+{
+    uint64 file;         // position in the list of files to import
+    uint64 offset;       // position in the file
+    uint64 start;        // position in the chunk
+    uint64 len;
+    bool last;           // the file ends with this piece
+    bool failed;         // the file could not be read completely
+};
+
+// pieces of one or more host files, handed from the reading thread to the writer
+struct ImportChunk
+{
+    unsigned char* data;
+    uint64 used;
+    std::vector<ImportPiece> pieces;
+};
+
+// passes chunks from one thread to the other, pop() waits until there is one
+class ImportQueue
+{
+  public:
+    void push( ImportChunk* chunk );
+    ImportChunk* pop();
+  private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<ImportChunk*> chunks;
+};
+
+// Runs the asynchronous operations of all storages, such as Stream::readAsync, on a
+// few threads of its own which are started on first use. The operations block these
+// threads while they wait for the disk, but not the threads which started them.
+class IoExecutor
+{
+  public:
+    static IoExecutor& instance();
+    ~IoExecutor();
+    void post( const std::function<void()>& task );
+  private:
+    IoExecutor();
+    void run();
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<std::function<void()> > tasks;
+    std::vector<std::thread> threads;
+    bool stopping;
+};
+
+// runs f on the I/O threads, the future gets its result
+template<class T> static std::future<T> runAsync( const std::function<T()>& f )
+{
+    std::shared_ptr<std::packaged_task<T()> > task( new std::packaged_task<T()>( f ) );
+    std::future<T> result = task->get_future();
+    IoExecutor::instance().post( [task]() { (*task)(); } );
+    return result;
+}
+
+// work of Storage::forEachStream: a directory still to be listed, or up to
+// WALKBATCH streams found in one, still to be visited
+struct WalkTask
+{
+    bool dir;
+    uint64 index;        // of the directory in the tree
+    std::string path;    // of the directory, ending with a slash
+    std::vector<EntryHandle> handles;  // the streams
+    std::vector<std::string> names;    // with their full names
+    std::vector<uint64> sizes;         // and sizes
+};
+
+// the tasks made by one thread of Storage::forEachStream; the thread takes them
+// from the back, the others steal from the front when they run out
+struct WalkDeque
+{
+    std::mutex mutex;
+    std::deque<WalkTask> tasks;
 };
 
 } // namespace POLE
@@ -303,19 +562,149 @@ std::wstring POLE::UTF8toUTF16(const std::string &utf8) {
 
 #endif //POLE_USE_UTF16_FILENAMES
 
-static void fileCheck(std::fstream &file)
+// The file is accessed by position only, never through a shared file position,
+// so that several threads can read and write different sectors at the same time.
+
+static int openFile(const std::string &filename, bool bWrite, bool bCreate)
+{
+#ifdef POLE_WIN
+    int mode = _O_BINARY | (bWrite ? _O_RDWR : _O_RDONLY) | (bCreate ? _O_CREAT | _O_TRUNC : 0);
+#ifdef POLE_USE_UTF16_FILENAMES
+    return _wopen(UTF8toUTF16(filename).c_str(), mode, _S_IREAD | _S_IWRITE);
+#else
+    return _open(filename.c_str(), mode, _S_IREAD | _S_IWRITE);
+#endif
+#else
+    int mode = (bWrite ? O_RDWR : O_RDONLY) | (bCreate ? O_CREAT | O_TRUNC : 0);
+    return ::open(filename.c_str(), mode, 0666);
+#endif
+}
+
+static void closeFile(int fd)
 {
-    bool bGood, bFail, bEof, bBad;
-    bool bNOTOK;
-    bGood = file.good();
-    bFail = file.fail();
-    bEof = file.eof();
-    bBad = file.bad();
-    if (bFail || bEof || bBad)
-        bNOTOK = true; //this doesn't really do anything, but it is a good place to set a breakpoint!
-    file.clear();
+#ifdef POLE_WIN
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+static uint64 fileSize(int fd)
+{
+#ifdef POLE_WIN
+    int64 size = _lseeki64(fd, 0, SEEK_END);
+#else
+    int64 size = ::lseek(fd, 0, SEEK_END);
+#endif
+    return size < 0 ? 0 : static_cast<uint64>(size);
+}
+
+// returns the number of bytes read, less than len only at the end of the file or on errors
+static uint64 readAt(int fd, uint64 pos, unsigned char* data, uint64 len)
+{
+    uint64 bytes = 0;
+    while (bytes < len)
+    {
+        uint64 count = len - bytes;
+        if (count > 0x40000000) count = 0x40000000;
+#ifdef POLE_WIN
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = static_cast<DWORD>(pos + bytes);
+        ov.OffsetHigh = static_cast<DWORD>((pos + bytes) >> 32);
+        DWORD got = 0;
+        if (!ReadFile((HANDLE)_get_osfhandle(fd), data + bytes, static_cast<DWORD>(count), &got, &ov) || got == 0)
+            break;
+#else
+        ssize_t got = ::pread(fd, data + bytes, count, pos + bytes);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+#endif
+        bytes += got;
+    }
+    return bytes;
+}
+
+// returns the number of bytes written, less than len only on errors
+static uint64 writeAt(int fd, uint64 pos, const unsigned char* data, uint64 len)
+{
+    uint64 bytes = 0;
+    while (bytes < len)
+    {
+        uint64 count = len - bytes;
+        if (count > 0x40000000) count = 0x40000000;
+#ifdef POLE_WIN
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = static_cast<DWORD>(pos + bytes);
+        ov.OffsetHigh = static_cast<DWORD>((pos + bytes) >> 32);
+        DWORD put = 0;
+        if (!WriteFile((HANDLE)_get_osfhandle(fd), data + bytes, static_cast<DWORD>(count), &put, &ov) || put == 0)
+            break;
+#else
+        ssize_t put = ::pwrite(fd, data + bytes, count, pos + bytes);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            break;
+#endif
+        bytes += put;
+    }
+    return bytes;
+}
+
+// reserves disk space for len bytes from pos, where the system can do that without
+// changing the size of the file; what is past the end is given back on close
+static void preallocFile(int fd, uint64 pos, uint64 len)
+{
+#if defined(POLE_WIN)
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = static_cast<LONGLONG>(pos + len);
+    SetFileInformationByHandle((HANDLE)_get_osfhandle(fd), FileAllocationInfo, &info, sizeof(info));
+#elif defined(__linux__)
+    ::fallocate(fd, FALLOC_FL_KEEP_SIZE, pos, len);
+#else
+    (void)fd; (void)pos; (void)len;
+#endif
+}
+
+// sets the size of the file
+static bool setFileSize(int fd, uint64 size)
+{
+#ifdef POLE_WIN
+    return _chsize_s(fd, static_cast<__int64>(size)) == 0;
+#else
+    return ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+#endif
+}
+
+// makes the file at least size bytes long, without ever cutting it or writing to
+// it, as streams may be writing their sectors meanwhile. Those all lie below size,
+// so extending the file when it is found shorter loses nothing of theirs.
+static bool growFile(int fd, uint64 size)
+{
+    if (size == 0)
+        return true;
+#if defined(__linux__)
+    if (::fallocate(fd, 0, size - 1, 1) == 0)
+        return true;
+#endif
+    if (fileSize(fd) >= size)
+        return true;
+    return setFileSize(fd, size);
+}
+
+// makes sure everything written to the file so far is on disk
+static bool syncFile(int fd)
+{
+#ifdef POLE_WIN
+    return _commit(fd) == 0;
+#else
+    return ::fsync(fd) == 0;
+#endif
 }
-    
 
 static inline uint32 readU16( const unsigned char* ptr )
 {
@@ -341,6 +730,129 @@ static inline void writeU32( unsigned char* ptr, uint32 data )
   ptr[3] = (unsigned char)((data >> 24) & 0xff);
 }
 
+// simple upper case mapping, used to order directory entries as the specification
+// requires; covers Latin-1, Latin Extended-A, Greek and Cyrillic, other characters
+// are left alone
+static inline uint32 foldUpper( uint32 c )
+{
+  if( c < 0x80 )
+    return ( c >= 'a' && c <= 'z' ) ? c - 0x20 : c;
+  if( c < 0x100 )
+  {
+    if( c >= 0xe0 && c <= 0xfe && c != 0xf7 ) return c - 0x20;
+    if( c == 0xff ) return 0x178;
+    return c;
+  }
+  if( c < 0x180 )
+  {
+    if( ( c >= 0x100 && c <= 0x12f ) || ( c >= 0x132 && c <= 0x137 ) || ( c >= 0x14a && c <= 0x177 ) )
+      return c & ~1u;
+    if( ( c >= 0x139 && c <= 0x148 ) || ( c >= 0x179 && c <= 0x17e ) )
+      return ( c & 1 ) ? c : c - 1;
+    return c;
+  }
+  if( c >= 0x3b1 && c <= 0x3cb ) return ( c == 0x3c2 ) ? 0x3a3 : c - 0x20;
+  if( c >= 0x430 && c <= 0x44f ) return c - 0x20;
+  if( c >= 0x450 && c <= 0x45f ) return c - 0x50;
+  return c;
+}
+
+// converts an UTF-8 name into UTF-16LE, returns the number of code units.
+// Bytes which are not valid UTF-8 are taken as Latin-1 characters.
+static uint64 UTF8toUTF16LE( const std::string& utf8, std::vector<unsigned char>& utf16 )
+{
+  utf16.clear();
+  utf16.reserve( utf8.length()*2 );
+  std::string::size_type i = 0;
+  while( i < utf8.length() )
+  {
+    uint32 c = (unsigned char) utf8[i];
+    unsigned n = 0;
+    if( c >= 0xf0 && c < 0xf5 ) n = 3;
+    else if( c >= 0xe0 && c < 0xf0 ) n = 2;
+    else if( c >= 0xc2 && c < 0xe0 ) n = 1;
+    bool ok = ( i + n < utf8.length() );
+    for( unsigned k = 1; ok && k <= n; k++ )
+      ok = ( ( (unsigned char) utf8[i+k] & 0xc0 ) == 0x80 );
+    if( n && ok )
+    {
+      c &= ( 0x3f >> n );
+      for( unsigned k = 1; k <= n; k++ )
+        c = ( c << 6 ) | ( (unsigned char) utf8[i+k] & 0x3f );
+      i += n + 1;
+    }
+    else
+      i++;
+    if( c >= 0x10000 )
+    {
+      c -= 0x10000;
+      utf16.push_back( (unsigned char)( ( 0xd800 + ( c >> 10 ) ) & 0xff ) );
+      utf16.push_back( (unsigned char)( ( 0xd800 + ( c >> 10 ) ) >> 8 ) );
+      c = 0xdc00 + ( c & 0x3ff );
+    }
+    utf16.push_back( (unsigned char)( c & 0xff ) );
+    utf16.push_back( (unsigned char)( c >> 8 ) );
+  }
+  return utf16.size() / 2;
+}
+
+// converts len code units of UTF-16LE into UTF-8; unpaired surrogates are kept
+// as three byte sequences so that the conversion back is lossless
+static void UTF16LEtoUTF8( const unsigned char* utf16, uint64 len, std::string& utf8 )
+{
+  utf8.clear();
+  utf8.reserve( len );
+  for( uint64 i = 0; i < len; i++ )
+  {
+    uint32 c = readU16( utf16 + i*2 );
+    if( c >= 0xd800 && c < 0xdc00 && i+1 < len )
+    {
+      uint32 c2 = readU16( utf16 + (i+1)*2 );
+      if( c2 >= 0xdc00 && c2 < 0xe000 )
+      {
+        c = 0x10000 + ( ( c - 0xd800 ) << 10 ) + ( c2 - 0xdc00 );
+        i++;
+      }
+    }
+    if( c < 0x80 )
+      utf8 += (char) c;
+    else if( c < 0x800 )
+    {
+      utf8 += (char)( 0xc0 | ( c >> 6 ) );
+      utf8 += (char)( 0x80 | ( c & 0x3f ) );
+    }
+    else if( c < 0x10000 )
+    {
+      utf8 += (char)( 0xe0 | ( c >> 12 ) );
+      utf8 += (char)( 0x80 | ( ( c >> 6 ) & 0x3f ) );
+      utf8 += (char)( 0x80 | ( c & 0x3f ) );
+    }
+    else
+    {
+      utf8 += (char)( 0xf0 | ( c >> 18 ) );
+      utf8 += (char)( 0x80 | ( ( c >> 12 ) & 0x3f ) );
+      utf8 += (char)( 0x80 | ( ( c >> 6 ) & 0x3f ) );
+      utf8 += (char)( 0x80 | ( c & 0x3f ) );
+    }
+  }
+}
+
+// builds the compare key of a name, as kept in the arena by DirTree::storeName;
+// returns its length in code units
+static uint64 compareKey( const std::string& name, std::vector<unsigned char>& key )
+{
+  uint64 len = UTF8toUTF16LE( name, key );
+  if( len > 31 ) len = 31;
+  for( uint64 j = 0; j < len; j++ )
+  {
+    uint32 c = foldUpper( readU16( &key[j*2] ) );
+    key[j*2] = (unsigned char)( c >> 8 );
+    key[j*2+1] = (unsigned char)( c & 0xff );
+  }
+  key.resize( len*2 );
+  return len;
+}
+
 static const unsigned char pole_magic[] = 
  { 0xd0, 0xcf, 0x11, 0xe0, 0xa1, 0xb1, 0x1a, 0xe1 };
 
@@ -349,6 +861,7 @@ static const unsigned char pole_magic[] =
 Header::Header()
 :   b_shift(9),                 // [1EH,02] size of sectors in power-of-two; typically 9 indicating 512-byte sectors
     s_shift(6),                 // [20H,02] size of mini-sectors in power-of-two; typically 6 indicating 64-byte mini-sectors
+    num_dirent(0),              // [28H,04] number of SECTs in the directory chain; 0 for version 3
     num_bat(0),                 // [2CH,04] number of SECTs in the FAT chain
     dirent_start(0),            // [30H,04] first SECT in the directory chain
     threshold(4096),            // [38H,04] maximum size for a mini stream; typically 4096 bytes
@@ -381,6 +894,7 @@ bool Header::valid()
 void Header::load( const unsigned char* buffer ) {
   b_shift      = readU16( buffer + 0x1e ); // [1EH,02] size of sectors in power-of-two; typically 9 indicating 512-byte sectors and 12 for 4096
   s_shift      = readU16( buffer + 0x20 ); // [20H,02] size of mini-sectors in power-of-two; typically 6 indicating 64-byte mini-sectors
+  num_dirent   = readU32( buffer + 0x28 ); // [28H,04] number of SECTs in the directory chain; 0 for version 3
   num_bat      = readU32( buffer + 0x2c ); // [2CH,04] number of SECTs in the FAT chain
   dirent_start = readU32( buffer + 0x30 ); // [30H,04] first SECT in the directory chain
   threshold    = readU32( buffer + 0x38 ); // [38H,04] maximum size for a mini stream; typically 4096 bytes
@@ -406,10 +920,11 @@ void Header::save( unsigned char* buffer )
   writeU32( buffer + 12, 0 );             // unknown
   writeU32( buffer + 16, 0 );             // unknown
   writeU16( buffer + 24, 0x003e );        // revision ?
-  writeU16( buffer + 26, 3 );             // version ?
+  writeU16( buffer + 26, (b_shift > 9) ? 4 : 3 ); // version: 3 for 512-byte sectors, 4 for 4096
   writeU16( buffer + 28, 0xfffe );        // unknown
   writeU16( buffer + 0x1e, (uint32) b_shift );
   writeU16( buffer + 0x20, (uint32) s_shift );
+  writeU32( buffer + 0x28, (uint32) num_dirent );
   writeU32( buffer + 0x2c, (uint32) num_bat );
   writeU32( buffer + 0x30, (uint32) dirent_start );
   writeU32( buffer + 0x38, (uint32) threshold );
@@ -428,6 +943,7 @@ void Header::debug()
   std::cout << std::endl;
   std::cout << "b_shift " << b_shift << std::endl;
   std::cout << "s_shift " << s_shift << std::endl;
+  std::cout << "num_dirent " << num_dirent << std::endl;
   std::cout << "num_bat " << num_bat << std::endl;
   std::cout << "dirent_start " << dirent_start << std::endl;
   std::cout << "threshold " << threshold << std::endl;
@@ -452,14 +968,25 @@ const uint64 AllocTable::MetaBat = 0xfffffffc;
 
 AllocTable::AllocTable()
 :   blockSize(4096),
+    counters(0),
     data(),
     dirtyBlocks(),
-    bMaybeFragmented(true)
+    firstFree(0),
+    frozen()
 {
   // initial size
   resize( 128 );
 }
 
+void AllocTable::clear()
+{
+  data.clear();
+  dirtyBlocks.clear();
+  frozen.clear();
+  firstFree = 0;
+  resize( 128 );
+}
+
 uint64 AllocTable::count()
 {
   return static_cast<uint64>(data.size());
@@ -482,8 +1009,12 @@ void AllocTable::resize( uint64 newsize )
   uint64 oldsize = static_cast<uint64>(data.size());
   data.resize( newsize );
   if( newsize > oldsize )
+  {
     for( uint64 i = oldsize; i<newsize; i++ )
       data[i] = Avail;
+    if( firstFree > oldsize )
+      firstFree = oldsize;
+  }
 }
 
 // make sure there're still free blocks
@@ -505,8 +1036,8 @@ void AllocTable::set( uint64 index, uint64 value )
 {
   if( index >= count() ) resize( index + 1);
   data[ index ] = value;
-  if (value == Avail)
-      bMaybeFragmented = true;
+  if (value == Avail && index < firstFree)
+      firstFree = index;
 }
 
 void AllocTable::setChain( std::vector<uint64> chain )
@@ -538,32 +1069,46 @@ std::vector<uint64> AllocTable::follow( uint64 start )
     p = data[ p ];
   }
 
+  if( counters )
+  {
+    counters->add( IoCounters::ChainFollows );
+    counters->add( IoCounters::ChainLinks, chain.size() );
+  }
   return chain;
 }
 
 unsigned AllocTable::unused()
 {
-  // find first available block
+  // find first available block, starting where the previous search ended
   unsigned int maxIdx = (unsigned int) data.size();
-  if (bMaybeFragmented)
-  {
-      for( unsigned i = 0; i < maxIdx; i++ )
-        if( data[i] == Avail )
-          return i;
-  }
+  for( uint64 i = firstFree; i < maxIdx; i++ )
+    if( data[i] == Avail && !isFrozen( i ) )
+    {
+      firstFree = i;
+      return (unsigned) i;
+    }
   
-  // completely full, so enlarge the table
-  unsigned int block = maxIdx;
-  resize( maxIdx );
-  bMaybeFragmented = false;
-  return block;      
+  // completely full, the caller will enlarge the table by setting the new block
+  firstFree = maxIdx;
+  return maxIdx;
 }
 
-void AllocTable::load( const unsigned char* buffer, uint64 len )
+// returns the block unused() would give after n others were taken, without taking any
+uint64 AllocTable::unusedAfter( uint64 n )
 {
-  resize( len / 4 );
-  for( unsigned i = 0; i < count(); i++ )
-    set( i, readU32( buffer + i*4 ) );
+  uint64 maxIdx = count();
+  for( uint64 i = firstFree; i < maxIdx; i++ )
+    if( data[i] == Avail && !isFrozen( i ) && n-- == 0 )
+      return i;
+  return maxIdx + n;
+}
+
+// fills in the n entries from first on, which the table must have already;
+// different parts of the table may be loaded by different threads at once
+void AllocTable::load( const unsigned char* buffer, uint64 first, uint64 n )
+{
+  for( uint64 i = 0; i < n; i++ )
+    data[ first + i ] = readU32( buffer + i*4 );
 }
 
 // return space required to save this dirtree
@@ -583,34 +1128,64 @@ bool AllocTable::isDirty()
     return (dirtyBlocks.size() > 0);
 }
 
+bool AllocTable::isDirtyBlock(uint64 blockIdx)
+{
+    return dirtyBlocks.count(blockIdx) > 0;
+}
+
+// remembers which blocks are in use now; until the next freeze() they are not
+// given out again, even if they get freed
+void AllocTable::freeze()
+{
+    frozen.assign(data.size(), 0);
+    for (uint64 idx = 0; idx < count(); idx++)
+        frozen[idx] = (data[idx] != Avail);
+    firstFree = 0;
+}
+
+// keeps blocks[idx] from being given out as well where it is non-zero, until
+// the next freeze()
+void AllocTable::keep(const std::vector<char>& blocks)
+{
+    if (frozen.size() < blocks.size())
+        frozen.resize(blocks.size(), 0);
+    for (uint64 idx = 0; idx < blocks.size(); idx++)
+        if (blocks[idx])
+            frozen[idx] = 1;
+}
+
+const std::vector<char>& AllocTable::frozenBlocks()
+{
+    return frozen;
+}
+
+bool AllocTable::isFrozen(uint64 index)
+{
+    return index < frozen.size() && frozen[index];
+}
+
 void AllocTable::markAsDirty(uint64 dataIndex, int64 bigBlockSize)
 {
-    uint64 dbidx = dataIndex / (bigBlockSize / sizeof(uint32));
-    for (uint64 idx = 0; idx < static_cast<uint64>(dirtyBlocks.size()); idx++)
-    {
-        if (dirtyBlocks[idx] == dbidx)
-            return;
-    }
-    dirtyBlocks.push_back(dbidx);
+    dirtyBlocks.insert(dataIndex / (bigBlockSize / sizeof(uint32)));
 }
 
 void AllocTable::flush(std::vector<uint64> blocks, StorageIO *const io, int64 bigBlockSize)
 {
-    unsigned char *buffer = new unsigned char[bigBlockSize * blocks.size()];
-    save(buffer);
-    for (uint64 idx = 0; idx < static_cast<uint64>(blocks.size()); idx++)
+    // serialize only the dirty sectors; entries past the end of the table are unused
+    uint64 perBlock = bigBlockSize / sizeof(uint32);
+    unsigned char *buffer = new unsigned char[bigBlockSize];
+    std::set<uint64>::iterator it;
+    for (it = dirtyBlocks.begin(); it != dirtyBlocks.end(); ++it)
     {
-        bool bDirty = false;
-        for (uint64 idx2 = 0; idx2 < static_cast<uint64>(dirtyBlocks.size()); idx2++)
+        uint64 idx = *it;
+        if (idx >= static_cast<uint64>(blocks.size()))
+            continue;
+        for (uint64 j = 0; j < perBlock; j++)
         {
-            if (dirtyBlocks[idx2] == idx)
-            {
-                bDirty = true;
-                break;
-            }
+            uint64 dataIdx = idx*perBlock + j;
+            writeU32(buffer + j*4, (uint32) (dataIdx < count() ? data[dataIdx] : Avail));
         }
-        if (bDirty)
-            io->saveBigBlock(blocks[idx], 0, &buffer[bigBlockSize*idx], bigBlockSize);
+        io->saveBigBlock(blocks[idx], 0, buffer, bigBlockSize);
     }
     dirtyBlocks.clear();
     delete[] buffer;
@@ -631,43 +1206,46 @@ void AllocTable::debug()
   }
 }
 
-// =========== DirEntry ==========
-// "A node with a shorter name is less than a node with a inter name"
-// "For nodes with the same length names, compare the two names." 
-// --Windows Compound Binary File Format Specification, Section 2.5
-int DirEntry::compare(const DirEntry& de)
-{
-    return compare(de.name);
-}
-
-int DirEntry::compare(const std::string& name2)
-{
-    if (name.length() < name2.length())
-        return -1;
-    else if (name.length() > name2.length())
-        return 1;
-    else
-        return name.compare(name2);
-}
-
-
 // =========== DirTree ==========
 
 const uint64 DirTree::End = 0xffffffff;
 
 DirTree::DirTree(int64 bigBlockSize)
 :   entries(),
-    dirtyBlocks()
+    arena(),
+    dirtyBlocks(),
+    lazyIo(0),
+    lazyBlocks(),
+    lazyLoaded(),
+    lazyPerBlock(0),
+    freeHint(0),
+    generations(),
+    parents(),
+    wideSizes(false),
+    controlPrefixes(0)
 {
   clear(bigBlockSize);
 }
 
+// version 3 files may have garbage in the high half of stream sizes,
+// which must be ignored then
+void DirTree::setWideSizes( bool wide )
+{
+  wideSizes = wide;
+}
+
 void DirTree::clear(int64 bigBlockSize)
 {
   // leave only root entry
+  lazyIo = 0;
+  freeHint = 1;
+  generations.clear();
+  parents.clear();
   entries.resize( 1 );
+  arena.clear();
+  controlPrefixes = 0;
   entries[0].valid = true;
-  entries[0].name = "Root Entry";
+  setName( &entries[0], "Root Entry" );
   entries[0].dir = true;
   entries[0].size = 0;
   entries[0].start = End;
@@ -684,6 +1262,7 @@ inline uint64 DirTree::entryCount()
 
 uint64 DirTree::unusedEntryCount()
 {
+    loadAll();
     uint64 nFound = 0;
     for (uint64 idx = 0; idx < entryCount(); idx++)
     {
@@ -696,30 +1275,80 @@ uint64 DirTree::unusedEntryCount()
 DirEntry* DirTree::entry( uint64 index )
 {
   if( index >= entryCount() ) return (DirEntry*) 0;
+  if( lazyIo ) loadBlock( index / lazyPerBlock );
   return &entries[ index ];
 }
 
+// returns the entry only if it is still the one the caller knew, i.e. it
+// has not been deleted since generation( index ) was taken
+DirEntry* DirTree::entry( uint64 index, uint32 gen )
+{
+  DirEntry* e = entry( index );
+  if( !e || !e->valid || generation( index ) != gen ) return (DirEntry*) 0;
+  return e;
+}
+
+uint32 DirTree::generation( uint64 index )
+{
+  return ( index < generations.size() ) ? generations[index] : 0;
+}
+
+// the generations the entries are to have once the directory is read again from
+// the file, see StorageIO::revert: the entries in use may be gone then, or others
+// in their place, so the handles to them must not find anything anymore. Entries
+// not decoded yet have no handles.
+std::vector<uint32> DirTree::nextGenerations()
+{
+  std::vector<uint32> gens( entryCount(), 0 );
+  for( uint64 i = 0; i < gens.size(); i++ )
+    gens[i] = generation( i ) + ( entries[i].valid ? 1 : 0 );
+  return gens;
+}
+
+void DirTree::setGenerations( const std::vector<uint32>& gens )
+{
+  generations = gens;
+}
+
 int64 DirTree::indexOf( DirEntry* e )
 {
-  for( uint64 i = 0; i < entryCount(); i++ )
-    if( entry( i ) == e ) return i;
-    
-  return -1;
+  // entries are stored contiguously, so the index follows from the address
+  if( !e || entries.empty() ) return -1;
+  if( e < &entries[0] || e >= &entries[0] + entryCount() ) return -1;
+  return e - &entries[0];
 }
 
 int64 DirTree::parent( uint64 index )
 {
-  // brute-force, basically we iterate for each entries, find its children
-  // and check if one of the children is 'index'
-  for( uint64 j=0; j<entryCount(); j++ )
+  // the parents of all entries are found with one walk over the tree,
+  // new entries are added by setParent
+  if( parents.empty() )
   {
-    std::vector<uint64> chi = children( j );
-    for( unsigned i=0; i<chi.size();i++ )
-      if( chi[i] == index )
-        return j;
+    parents.assign( entryCount(), static_cast<uint32>( End ) );
+    std::vector<uint64> dirs( 1, 0 );
+    while( !dirs.empty() )
+    {
+      uint64 dirIdx = dirs.back();
+      dirs.pop_back();
+      std::vector<uint64> chi = children( dirIdx );
+      for( uint64 i = 0; i < chi.size(); i++ )
+      {
+        // skip entries seen before, damaged files may have cycles
+        if( chi[i] == 0 || parents[chi[i]] != End ) continue;
+        parents[chi[i]] = static_cast<uint32>( dirIdx );
+        if( entry( chi[i] )->dir ) dirs.push_back( chi[i] );
+      }
+    }
   }
-        
-  return -1;
+  if( index >= parents.size() || parents[index] == End ) return -1;
+  return parents[index];
+}
+
+void DirTree::setParent( uint64 index, uint64 parentIdx )
+{
+  if( parents.empty() ) return;
+  if( index >= parents.size() ) parents.resize( entryCount(), static_cast<uint32>( End ) );
+  parents[index] = static_cast<uint32>( parentIdx );
 }
 
 std::string DirTree::fullName( uint64 index )
@@ -727,25 +1356,84 @@ std::string DirTree::fullName( uint64 index )
   // don't use root name ("Root Entry"), just give "/"
   if( index == 0 ) return "/";
 
-  std::string result = entry( index )->name;
+  std::string result = name( entry( index ) );
   result.insert( 0,  "/" );
-  uint64 p = parent( index );
-  DirEntry * _entry = 0;
+  int64 p = parent( index );
   while( p > 0 )
   {
-    _entry = entry( p );
-    if (_entry->dir && _entry->valid)
-    {
-      result.insert( 0,  _entry->name);
-      result.insert( 0,  "/" );
-    }
-    --p;
-    index = p;
-    if( index <= 0 ) break;
+    result.insert( 0,  name( entry( p ) ) );
+    result.insert( 0,  "/" );
+    p = parent( p );
   }
   return result;
 }
 
+// Each name takes 4 bytes per UTF-16 code unit in the arena: first the compare key,
+// the name converted to upper case and stored big endian so that memcmp orders it
+// like the code units, then the name itself as UTF-16LE, exactly as on disk.
+std::string DirTree::name( const DirEntry* e )
+{
+  std::string result;
+  if( e && e->nameLength )
+    UTF16LEtoUTF8( &arena[e->name + e->nameLength*2], e->nameLength, result );
+  return result;
+}
+
+void DirTree::setName( DirEntry* e, const std::string& name )
+{
+  std::vector<unsigned char> utf16;
+  uint64 len = UTF8toUTF16LE( name, utf16 );
+  storeName( e, len ? &utf16[0] : 0, len );
+}
+
+void DirTree::storeName( DirEntry* e, const unsigned char* utf16, uint64 len )
+{
+  // max length for name is 31 chars, plus the terminating zero
+  if( len > 31 ) len = 31;
+
+  // reuse the old slot of the arena if the new name fits, append otherwise
+  if( len > e->nameLength || e->name + e->nameLength*4 > arena.size() )
+  {
+    e->name = static_cast<uint32>( arena.size() );
+    arena.resize( arena.size() + len*4 );
+  }
+  unsigned char* key = len ? &arena[e->name] : 0;
+  for( uint64 j = 0; j < len; j++ )
+  {
+    uint32 c = foldUpper( readU16( utf16 + j*2 ) );
+    key[j*2] = (unsigned char)( c >> 8 );
+    key[j*2+1] = (unsigned char)( c & 0xff );
+  }
+  if( len ) memcpy( key + len*2, utf16, len*2 );
+  e->nameLength = static_cast<uint16>( len );
+  if( len && readU16( utf16 ) < 32 )
+    controlPrefixes |= 1u << readU16( utf16 );
+}
+
+// "A node with a shorter name is less than a node with a inter name"
+// "For nodes with the same length names, compare the two names." 
+// --Windows Compound Binary File Format Specification, Section 2.5
+// Names are compared by their upper case form (see storeName), key2 must be built the same way.
+int DirTree::compare( const DirEntry* e, const unsigned char* key2, uint64 len2 )
+{
+  if( e->nameLength < len2 )
+    return -1;
+  else if( e->nameLength > len2 )
+    return 1;
+  else if( !len2 )
+    return 0;
+  return memcmp( &arena[e->name], key2, len2*2 );
+}
+
+int DirTree::compare( const DirEntry* e, const DirEntry* e2 )
+{
+  if( e->nameLength != e2->nameLength )
+    return e->nameLength < e2->nameLength ? -1 : 1;
+  if( !e2->nameLength )
+    return 0;
+  return compare( e, &arena[e2->name], e2->nameLength );
+}
+
 // given a fullname (e.g "/ObjectPool/_1020961869"), find the entry
 // if not found and create is false, return 0
 // if create is true, a new entry is returned
@@ -814,7 +1502,7 @@ DirEntry* DirTree::entry( const std::string& name, bool create, int64 bigBlockSi
        index = unused();
        DirEntry* e = entry( index );
        e->valid = true;
-       e->name = *it;
+       setName( e, *it );
        e->dir = (levelsLeft > 0);
        if (!e->dir)
            e->size = streamSize;
@@ -832,7 +1520,7 @@ DirEntry* DirTree::entry( const std::string& name, bool create, int64 bigBlockSi
        else
        {
            DirEntry* closeE = entry( closest );
-           if (closeE->compare(*e) < 0)
+           if (compare(closeE, e) < 0)
            {
                e->prev = closeE->next;
                e->next = End;
@@ -847,40 +1535,36 @@ DirEntry* DirTree::entry( const std::string& name, bool create, int64 bigBlockSi
            markAsDirty(closest, bigBlockSize);
        }
        markAsDirty(index, bigBlockSize);
-       uint64 bbidx = index / (bigBlockSize / 128);
-       std::vector <uint64> blocks = io->bbat->follow(io->header->dirent_start);
-       while (blocks.size() <= bbidx)
-       {
-           uint64 nblock = io->bbat->unused();
-           if (blocks.size() > 0)
-           {
-               io->bbat->set(blocks[static_cast<uint64>(blocks.size())-1], nblock);
-               io->bbat->markAsDirty(blocks[static_cast<uint64>(blocks.size())-1], bigBlockSize);
-           }
-           io->bbat->set(nblock, AllocTable::Eof);
-           io->bbat->markAsDirty(nblock, bigBlockSize);
-           blocks.push_back(nblock);
-           uint64 bbidx = nblock / (io->bbat->blockSize / sizeof(uint64));
-           while (bbidx >= io->header->num_bat)
-               io->addbbatBlock();
-       }
+       setParent(index, parent2);
+       io->reserveDirectory(index + 1);
      }
    }
 
    return entry( index );
 }
 
-// helper function: recursively find siblings of index
+// helper function: find siblings of index, in order. Trees written by inserting
+// sorted names degenerate into lists, so this keeps its own stack instead of recursing
 void dirtree_find_siblings( DirTree* dirtree, std::vector<uint64>& result, 
   uint64 index )
 {
-    DirEntry* e = dirtree->entry( index );
-    if (!e) return;
-    if (e->prev != DirTree::End)
-        dirtree_find_siblings(dirtree, result, e->prev);
-    result.push_back(index);
-    if (e->next != DirTree::End)
-        dirtree_find_siblings(dirtree, result, e->next);
+    std::vector<uint64> stack;
+    uint64 count = dirtree->entryCount();
+    for( ;; )
+    {
+        // the size checks guard against cycles in damaged files
+        DirEntry* e;
+        while( ( e = dirtree->entry( index ) ) != 0 && stack.size() <= count )
+        {
+            stack.push_back( index );
+            index = e->prev;
+        }
+        if( stack.empty() || result.size() >= count ) break;
+        index = stack.back();
+        stack.pop_back();
+        result.push_back( index );
+        index = dirtree->entry( index )->next;
+    }
 }
 
 std::vector<uint64> DirTree::children( uint64 index )
@@ -894,82 +1578,147 @@ std::vector<uint64> DirTree::children( uint64 index )
   return result;
 }
 
-uint64 dirtree_find_sibling( DirTree* dirtree, uint64 index, const std::string& name, uint64& closest ) {
+// Names such as "\005SummaryInformation" are also found without their leading
+// control character, as "/SummaryInformation", which is all earlier versions kept
+// of them. Only the characters some name of the directory starts with are tried.
+uint64 DirTree::find_child( uint64 index, const std::string& name, uint64& closest ) {
 
-    uint64 count = dirtree->entryCount();
-    DirEntry* e = dirtree->entry( index );
-    if (!e || !e->valid) return 0;
-    int cval = e->compare(name);
-    if (cval == 0)
-        return index;
-    if (cval > 0)
-    {
-        if (e->prev > 0 && e->prev < count)
-            return dirtree_find_sibling( dirtree, e->prev, name, closest );
-    }
-    else
-    {
-        if (e->next > 0 && e->next < count)
-            return dirtree_find_sibling( dirtree, e->next, name, closest );
-    }
-    closest = index;
-    return 0;
+  DirEntry* p = entry( index );
+  if( !p || !p->valid || p->child >= entryCount() ) return 0;
+
+  uint64 found = findSibling( p->child, name, closest );
+  if( found || name.empty() || (unsigned char) name[0] < 32 )
+    return found;
+  // names in sectors not decoded yet are not known, so then the characters used
+  // by Microsoft's implementation are tried as well
+  uint32 prefixes = controlPrefixes;
+  if( lazyIo )
+    prefixes |= ( 1u << 1 ) | ( 1u << 2 ) | ( 1u << 3 ) | ( 1u << 5 ) | ( 1u << 6 );
+  for( unsigned c = 1; c < 32; c++ )
+  {
+    if( !( prefixes & ( 1u << c ) ) ) continue;
+    uint64 other;
+    found = findSibling( p->child, std::string( 1, (char) c ) + name, other );
+    if( found ) return found;
+  }
+  return 0;
 }
 
-uint64 DirTree::find_child( uint64 index, const std::string& name, uint64& closest ) {
+// walks down the sibling tree from first; sets closest to where name would be
+// linked in if it is not found
+uint64 DirTree::findSibling( uint64 first, const std::string& name, uint64& closest ) {
 
   uint64 count = entryCount();
-  DirEntry* p = entry( index );
-  if (p && p->valid && p->child < count )
-    return dirtree_find_sibling( this, p->child, name, closest );
-  
+
+  // build the compare key once, see storeName
+  std::vector<unsigned char> key;
+  uint64 len = compareKey( name, key );
+
+  // the step limit guards against cycles in damaged files
+  uint64 i = first;
+  for( uint64 steps = 0; steps < count; steps++ )
+  {
+    DirEntry* e = entry( i );
+    if( !e->valid ) return 0;
+    int cval = compare( e, len ? &key[0] : 0, len );
+    if( cval == 0 )
+      return i;
+    uint64 link = ( cval > 0 ) ? e->prev : e->next;
+    if( link == 0 || link >= count )
+      break;
+    i = link;
+  }
+  closest = i;
   return 0;
 }
 
+void DirTree::loadEntry( const unsigned char* buffer, DirEntry& e )
+{
+  // parse name of this entry, which stored as Unicode 16-bit
+  // (name_len counts bytes, including the terminating zero)
+  int name_len = readU16( buffer + 0x40 );
+  if( name_len > 64 ) name_len = 64;
+  uint64 len = 0;
+  while( ( (int)len+1 )*2 < name_len && readU16( buffer + len*2 ) )
+    len++;
+  
+  // 2 = file (aka stream), 1 = directory (aka storage), 5 = root
+  unsigned type = buffer[ 0x42 ];
+  
+  e.valid = ( type != 0 );
+  storeName( &e, buffer, len );
+  e.start = readU32( buffer + 0x74 );
+  e.size = readU32( buffer + 0x78 );
+  if( wideSizes )
+    e.size |= (uint64) readU32( buffer + 0x7C ) << 32;
+  e.prev = readU32( buffer + 0x44 );
+  e.next = readU32( buffer + 0x48 );
+  e.child = readU32( buffer + 0x4C );
+  e.dir = ( type!=2 );
+  
+  // sanity checks
+  if( (type != 2) && (type != 1 ) && (type != 5 ) ) e.valid = false;
+  if( name_len < 1 ) e.valid = false;
+}
+
 void DirTree::load( unsigned char* buffer, uint64 size )
 {
+  lazyIo = 0;
+  freeHint = 0;
+  generations.clear();
+  parents.clear();
+  dirtyBlocks.clear();
   entries.clear();
+  arena.clear();
+  controlPrefixes = 0;
+  entries.resize( size/128 );
+  arena.reserve( size/128 * 64 );
   
   for( uint64 i = 0; i < size/128; i++ )
-  {
-    uint64 p = i * 128;
-    
-    // would be < 32 if first char in the name isn't printable
-    unsigned prefix = 32;
-    
-    // parse name of this entry, which stored as Unicode 16-bit
-    std::string name;
-    int name_len = readU16( buffer + 0x40+p );
-    if( name_len > 64 ) name_len = 64;
-    for( int j=0; ( buffer[j+p]) && (j<name_len); j+= 2 )
-      name.append( 1, buffer[j+p] );
-      
-    // first char isn't printable ? remove it...
-    if( buffer[p] < 32 )
-    { 
-      prefix = buffer[0]; 
-      name.erase( 0,1 ); 
-    }
-    
-    // 2 = file (aka stream), 1 = directory (aka storage), 5 = root
-    unsigned type = buffer[ 0x42 + p];
-    
-    DirEntry e;
-    e.valid = ( type != 0 );
-    e.name = name;
-    e.start = readU32( buffer + 0x74+p );
-    e.size = readU32( buffer + 0x78+p );
-    e.prev = readU32( buffer + 0x44+p );
-    e.next = readU32( buffer + 0x48+p );
-    e.child = readU32( buffer + 0x4C+p );
-    e.dir = ( type!=2 );
-    
-    // sanity checks
-    if( (type != 2) && (type != 1 ) && (type != 5 ) ) e.valid = false;
-    if( name_len < 1 ) e.valid = false;
-    
-    entries.push_back( e );
-  }  
+    loadEntry( buffer + i*128, entries[i] );
+}
+
+// Only remembers where the directory is: sectors are read and decoded the first
+// time one of their entries is accessed through entry( index ). The chain is
+// known and the entries are allocated (empty) up front, so that indices stay valid.
+void DirTree::loadLazily( StorageIO *const io, const std::vector<uint64>& blocks, int64 bigBlockSize )
+{
+  freeHint = 0;
+  generations.clear();
+  parents.clear();
+  dirtyBlocks.clear();
+  entries.clear();
+  arena.clear();
+  controlPrefixes = 0;
+  lazyPerBlock = bigBlockSize / 128;
+  lazyBlocks = blocks;
+  lazyLoaded.assign( blocks.size(), 0 );
+  entries.resize( blocks.size() * lazyPerBlock );
+  lazyIo = entries.size() ? io : 0;
+}
+
+void DirTree::loadBlock( uint64 blockIdx )
+{
+  if( blockIdx >= lazyLoaded.size() || lazyLoaded[blockIdx] ) return;
+  lazyLoaded[blockIdx] = 1;
+
+  uint64 blockSize = lazyPerBlock * 128;
+  std::vector<unsigned char> buffer( blockSize );
+  lazyIo->loadBigBlock( lazyBlocks[blockIdx], &buffer[0], blockSize );
+  uint64 first = blockIdx * lazyPerBlock;
+  for( uint64 i = 0; i < lazyPerBlock && first + i < entryCount(); i++ )
+    loadEntry( &buffer[i*128], entries[first + i] );
+}
+
+// decodes whatever is not loaded yet, needed before walking all entries
+void DirTree::loadAll()
+{
+  if( !lazyIo ) return;
+  for( uint64 idx = 0; idx < static_cast<uint64>(lazyLoaded.size()); idx++ )
+    loadBlock( idx );
+  lazyIo = 0;
+  lazyBlocks.clear();
+  lazyLoaded.clear();
 }
 
 // return space required to save this dirtree
@@ -978,55 +1727,61 @@ uint64 DirTree::size()
   return entryCount() * 128;
 }
 
-void DirTree::save( unsigned char* buffer )
+void DirTree::saveEntry( uint64 index, unsigned char* buffer )
 {
-  memset( buffer, 0, size() );
-  
-  // root is fixed as "Root Entry"
-  DirEntry* root = entry( 0 );
-  std::string name = "Root Entry";
-  for( unsigned int j = 0; j < name.length(); j++ )
-    buffer[ j*2 ] = name[j];
-  writeU16( buffer + 0x40, static_cast<uint32>(name.length()*2 + 2) );
-  writeU32( buffer + 0x74, 0xffffffff );
-  writeU32( buffer + 0x78, 0 );
-  writeU32( buffer + 0x44, 0xffffffff );
-  writeU32( buffer + 0x48, 0xffffffff );
-  writeU32( buffer + 0x4c, (uint32) root->child );
-  buffer[ 0x42 ] = 5;
-  //buffer[ 0x43 ] = 1; 
-
-  for( unsigned int i = 1; i < entryCount(); i++ )
+  memset( buffer, 0, 128 );
+  DirEntry* e = entry( index );
+  if( index == 0 )
   {
-    DirEntry* e = entry( i );
-    if( !e ) continue;
-    if( e->dir )
-    {
-      e->start = 0xffffffff;
-      e->size = 0;
-    }
-    
-    // max length for name is 32 chars
-    std::string name = e->name;
-    if( name.length() > 32 )
-      name.erase( 32, name.length() );
-      
-    // write name as Unicode 16-bit
-    for( unsigned j = 0; j < name.length(); j++ )
-      buffer[ i*128 + j*2 ] = name[j];
-
-    writeU16( buffer + i*128 + 0x40, static_cast<uint32>(name.length()*2 + 2) );
-    writeU32( buffer + i*128 + 0x74, (uint32) e->start );
-    writeU32( buffer + i*128 + 0x78, (uint32) e->size );
-    writeU32( buffer + i*128 + 0x44, (uint32) e->prev );
-    writeU32( buffer + i*128 + 0x48, (uint32) e->next );
-    writeU32( buffer + i*128 + 0x4c, (uint32) e->child );
-    if (!e->valid)
-        buffer[ i*128 + 0x42 ] = 0; //STGTY_INVALID
-    else
-        buffer[ i*128 + 0x42 ] = e->dir ? 1 : 2; //STGTY_STREAM or STGTY_STORAGE
-    buffer[ i*128 + 0x43 ] = 1; // always black
-  }  
+    // root is fixed as "Root Entry"
+    static const char rootName[] = "Root Entry";
+    for( unsigned int j = 0; rootName[j]; j++ )
+      buffer[ j*2 ] = rootName[j];
+    writeU16( buffer + 0x40, static_cast<uint32>( sizeof( rootName ) * 2 ) );
+    writeU32( buffer + 0x74, 0xffffffff );
+    writeU32( buffer + 0x78, 0 );
+    writeU32( buffer + 0x44, 0xffffffff );
+    writeU32( buffer + 0x48, 0xffffffff );
+    writeU32( buffer + 0x4c, (uint32) e->child );
+    buffer[ 0x42 ] = 5;
+    //buffer[ 0x43 ] = 1; 
+    return;
+  }
+  if( !e || !e->valid )
+  {
+    // unused entry, STGTY_INVALID
+    writeU32( buffer + 0x44, 0xffffffff );
+    writeU32( buffer + 0x48, 0xffffffff );
+    writeU32( buffer + 0x4c, 0xffffffff );
+    return;
+  }
+  if( e->dir )
+  {
+    e->start = 0xffffffff;
+    e->size = 0;
+  }
+  
+  // write name as Unicode 16-bit, as it was read (at most 31 chars, see storeName)
+  unsigned len = e->nameLength;
+  if( len )
+    memcpy( buffer, &arena[ e->name + len*2 ], len*2 );
+
+  writeU16( buffer + 0x40, len*2 + 2 );
+  writeU32( buffer + 0x74, (uint32) e->start );
+  writeU32( buffer + 0x78, (uint32) e->size );
+  if( wideSizes )
+    writeU32( buffer + 0x7C, (uint32) ( e->size >> 32 ) );
+  writeU32( buffer + 0x44, (uint32) e->prev );
+  writeU32( buffer + 0x48, (uint32) e->next );
+  writeU32( buffer + 0x4c, (uint32) e->child );
+  buffer[ 0x42 ] = e->dir ? 1 : 2; //STGTY_STORAGE or STGTY_STREAM
+  buffer[ 0x43 ] = 1; // always black
+}
+
+void DirTree::save( unsigned char* buffer )
+{
+  for( uint64 i = 0; i < entryCount(); i++ )
+    saveEntry( i, buffer + i*128 );
 }
 
 bool DirTree::isDirty()
@@ -1034,42 +1789,36 @@ bool DirTree::isDirty()
     return (dirtyBlocks.size() > 0);
 }
 
+bool DirTree::isDirtyBlock(uint64 blockIdx)
+{
+    return dirtyBlocks.count(blockIdx) > 0;
+}
+
 
 void DirTree::markAsDirty(uint64 dataIndex, int64 bigBlockSize)
 {
-    uint64 dbidx = dataIndex / (bigBlockSize / 128);
-    for (uint64 idx = 0; idx < static_cast<uint64>(dirtyBlocks.size()); idx++)
-    {
-        if (dirtyBlocks[idx] == dbidx)
-            return;
-    }
-    dirtyBlocks.push_back(dbidx);
+    dirtyBlocks.insert(dataIndex / (bigBlockSize / 128));
 }
 
+// writes the dirty sectors only, each of them padded with unused entries
 void DirTree::flush(std::vector<uint64> blocks, StorageIO *const io, int64 bigBlockSize, uint64 sb_start, uint64 sb_size)
 {
-    uint64 bufLen = size();
-    unsigned char *buffer = new unsigned char[bufLen];
-    save(buffer);
-    writeU32( buffer + 0x74, (uint32) sb_start );
-    writeU32( buffer + 0x78, (uint32) sb_size );
-    for (uint64 idx = 0; idx < static_cast<uint64>(blocks.size()); idx++)
+    uint64 perBlock = bigBlockSize / 128;
+    unsigned char *buffer = new unsigned char[bigBlockSize];
+    std::set<uint64>::iterator it;
+    for (it = dirtyBlocks.begin(); it != dirtyBlocks.end(); ++it)
     {
-        bool bDirty = false;
-        for (uint64 idx2 = 0; idx2 < static_cast<uint64>(dirtyBlocks.size()); idx2++)
+        uint64 idx = *it;
+        if (idx >= static_cast<uint64>(blocks.size()))
+            continue;
+        for (uint64 j = 0; j < perBlock; j++)
+            saveEntry(idx*perBlock + j, buffer + j*128);
+        if (idx == 0)
         {
-            if (dirtyBlocks[idx2] == idx)
-            {
-                bDirty = true;
-                break;
-            }
+            writeU32( buffer + 0x74, (uint32) sb_start );
+            writeU32( buffer + 0x78, (uint32) sb_size );
         }
-        uint64 bytesToWrite = bigBlockSize;
-        uint64 pos = bigBlockSize*idx;
-        if ((bufLen - pos) < bytesToWrite)
-            bytesToWrite = bufLen - pos;
-        if (bDirty)
-            io->saveBigBlock(blocks[idx], 0, &buffer[pos], bytesToWrite);
+        io->saveBigBlock(blocks[idx], 0, buffer, bigBlockSize);
     }
     dirtyBlocks.clear();
     delete[] buffer;
@@ -1077,15 +1826,133 @@ void DirTree::flush(std::vector<uint64> blocks, StorageIO *const io, int64 bigBl
 
 uint64 DirTree::unused()
 {
-    for (uint64 idx = 0; idx < static_cast<uint64>(entryCount()); idx++)
+    loadAll();
+    for (uint64 idx = freeHint; idx < static_cast<uint64>(entryCount()); idx++)
     {
         if (!entries[idx].valid)
+        {
+            freeHint = idx;
             return idx;
+        }
     }
     entries.push_back(DirEntry());
+    freeHint = entryCount()-1;
     return entryCount()-1;
 }
 
+// orders entry indexes the way siblings are ordered in the file
+struct DirEntryLess
+{
+    DirTree* tree;
+    DirEntryLess( DirTree* t ): tree( t ) {}
+    bool operator()( uint64 a, uint64 b ) const
+    {
+        return tree->compare( tree->entry( a ), tree->entry( b ) ) < 0;
+    }
+};
+
+// Creates the entries for all names at once, along with missing parent directories;
+// entries which exist already are kept. Instead of inserting new entries one by one,
+// the sibling tree of every directory which got new children is rebuilt, balanced,
+// from its sorted children. sizes[i], if present, is the size of a new stream names[i].
+// Returns the index of each named entry, or End if it could not be created (a stream
+// used as a directory).
+std::vector<uint64> DirTree::createEntries( const std::vector<std::string>& names, const std::vector<uint64>& sizes, int64 bigBlockSize )
+{
+    loadAll();
+    std::vector<uint64> result( names.size(), End );
+
+    // new entries are not linked into the sibling trees until the end,
+    // so they are found by parent and compare key here
+    std::map< std::pair<uint64, std::string>, uint64 > created;
+    std::map< uint64, std::vector<uint64> > newChildren;
+    std::vector<unsigned char> key;
+
+    for (uint64 i = 0; i < names.size(); i++)
+    {
+        const std::string& name = names[i];
+        std::vector<std::string> parts;
+        std::string::size_type start = 0, end = 0;
+        if (name.length() && name[0] == '/') start++;
+        while (start < name.length())
+        {
+            end = name.find_first_of('/', start);
+            if (end == std::string::npos) end = name.length();
+            parts.push_back(name.substr(start, end-start));
+            start = end+1;
+        }
+        if (parts.empty())
+            continue;
+        // a trailing slash asks for a directory
+        bool wantDir = name[name.length()-1] == '/';
+
+        uint64 index = 0;
+        uint64 level;
+        for (level = 0; level < parts.size(); level++)
+        {
+            if (!entries[index].dir)
+                break;
+            compareKey(parts[level], key);
+            std::pair<uint64, std::string> id(index, std::string(key.begin(), key.end()));
+            std::map< std::pair<uint64, std::string>, uint64 >::iterator it = created.find(id);
+            uint64 child = 0;
+            if (it != created.end())
+                child = it->second;
+            else
+            {
+                uint64 closest = End;
+                child = find_child(index, parts[level], closest);
+            }
+            if (!child)
+            {
+                child = unused();
+                DirEntry* e = &entries[child];
+                e->valid = true;
+                setName(e, parts[level]);
+                e->dir = (level+1 < parts.size()) || wantDir;
+                e->size = (!e->dir && i < sizes.size()) ? sizes[i] : 0;
+                e->start = AllocTable::Eof;
+                e->prev = End;
+                e->next = End;
+                e->child = End;
+                created[id] = child;
+                newChildren[index].push_back(child);
+                setParent(child, index);
+            }
+            index = child;
+        }
+        if (level == parts.size())
+            result[i] = index;
+    }
+
+    DirEntryLess less(this);
+    std::map< uint64, std::vector<uint64> >::iterator it;
+    for (it = newChildren.begin(); it != newChildren.end(); ++it)
+    {
+        std::vector<uint64>& added = it->second;
+        std::sort(added.begin(), added.end(), less);
+        std::vector<uint64> old = children(it->first);
+        std::vector<uint64> all(old.size() + added.size());
+        std::merge(old.begin(), old.end(), added.begin(), added.end(), all.begin(), less);
+        entries[it->first].child = static_cast<uint32>(linkBalanced(all, 0, all.size(), bigBlockSize));
+        markAsDirty(it->first, bigBlockSize);
+    }
+    return result;
+}
+
+// links sorted[lo..hi) into a balanced tree, returns its root
+uint64 DirTree::linkBalanced( const std::vector<uint64>& sorted, uint64 lo, uint64 hi, int64 bigBlockSize )
+{
+    if (lo >= hi)
+        return End;
+    uint64 mid = lo + (hi - lo) / 2;
+    uint64 index = sorted[mid];
+    entries[index].prev = static_cast<uint32>(linkBalanced(sorted, lo, mid, bigBlockSize));
+    entries[index].next = static_cast<uint32>(linkBalanced(sorted, mid+1, hi, bigBlockSize));
+    markAsDirty(index, bigBlockSize);
+    return index;
+}
+
 // Utility function to get the index of the parent dirEntry, given that we already have a full name it is relatively fast.
 // Then look for a sibling dirEntry that points to inIdx. In some circumstances, the dirEntry at inIdx will be the direct child
 // of the parent, in which case sibIdx will be returned as 0. A failure is indicated if both parentIdx and sibIdx are returned as 0.
@@ -1127,20 +1994,21 @@ uint64 DirTree::findSib(uint64 inIdx, uint64 sibIdx)
     if (sib->next == inIdx || sib->prev == inIdx)
         return sibIdx;
     DirEntry *targetSib = entry(inIdx);
-    int cval = sib->compare(*targetSib);
+    int cval = compare(sib, targetSib);
     if (cval > 0)
         return findSib(inIdx, sib->prev);
     else
         return findSib(inIdx, sib->next);
 }
 
-void DirTree::deleteEntry(DirEntry *dirToDel, const std::string& inFullName, int64 bigBlockSize)
+void DirTree::deleteEntry(DirEntry *dirToDel, uint64 parentIdx, int64 bigBlockSize)
 {
-    uint64 parentIdx;
-    uint64 sibIdx;
     uint64 inIdx = indexOf(dirToDel);
     uint64 nEntries = entryCount();
-    findParentAndSib(inIdx, inFullName, parentIdx, sibIdx);
+    uint64 sibIdx = 0;
+    DirEntry *parent2 = entry(parentIdx);
+    if (parent2 && parent2->child != inIdx)
+        sibIdx = findSib(inIdx, parent2->child);
     uint64 replIdx;
     if (!dirToDel->next || dirToDel->next > nEntries)
         replIdx = dirToDel->prev;
@@ -1192,6 +2060,11 @@ void DirTree::deleteEntry(DirEntry *dirToDel, const std::string& inFullName, int
         markAsDirty(parentIdx, bigBlockSize);
     }
     dirToDel->valid = false; //indicating that this entry is not in use
+    if (inIdx < freeHint)
+        freeHint = inIdx;
+    if (inIdx >= generations.size())
+        generations.resize(inIdx+1, 0);
+    generations[inIdx]++;
     markAsDirty(inIdx, bigBlockSize);
 }
 
@@ -1204,7 +2077,7 @@ void DirTree::debug()
     if( !e ) continue;
     std::cout << i << ": ";
     if( !e->valid ) std::cout << "INVALID ";
-    std::cout << e->name << " ";
+    std::cout << name( e ) << " ";
     if( e->dir ) std::cout << "(Dir) ";
     else std::cout << "(File) ";
     std::cout << e->size << " ";
@@ -1220,15 +2093,48 @@ void DirTree::debug()
   }
 }
 
+// =========== IoCounters ==========
+
+IoCounters::IoCounters()
+{
+  reset();
+}
+
+void IoCounters::add( int counter, uint64 n )
+{
+  value[counter].fetch_add( n, std::memory_order_relaxed );
+}
+
+uint64 IoCounters::get( int counter )
+{
+  return value[counter].load( std::memory_order_relaxed );
+}
+
+void IoCounters::reset()
+{
+  for( int i = 0; i < Count; i++ )
+    value[i].store( 0, std::memory_order_relaxed );
+  lastEnd.store( 0, std::memory_order_relaxed );
+}
+
+// counts a seek if the file is not accessed where the previous access ended
+void IoCounters::access( uint64 pos, uint64 len )
+{
+  if( lastEnd.exchange( pos + len, std::memory_order_relaxed ) != pos )
+    add( Seeks );
+}
+
 // =========== StorageIO ==========
 
 StorageIO::StorageIO( Storage* st, const char* fname )
 : storage(st),        
   filename(fname),
-  file(), 
+  fd(-1),
   result(Storage::Ok),        
   opened(false),        
   filesize(0),        
+  writeFailed(false),
+  reserved(0),
   writeable(false),        
   header(new Header()),        
     dirtree(new DirTree( (uint64_t) 1 << header->b_shift)),
@@ -1238,8 +2144,17 @@ StorageIO::StorageIO( Storage* st, const char* fname )
   mbat_blocks(),
   mbat_data(),
   mbatDirty(),
+  transacted(false),
+  openFlags(0),
+  flushPolicy(Storage::FlushOnClose),
+  flushAmount(0),
+  opsSinceFlush(0),
+  bytesSinceFlush(0),
+  lastFlush(time(0)),
   streams()
 {
+  bbat->counters = &counters;
+  sbat->counters = &counters;
   bbat->blockSize = (uint64) 1 << header->b_shift;
   sbat->blockSize = (uint64) 1 << header->s_shift;
 }
@@ -1253,59 +2168,72 @@ StorageIO::~StorageIO()
   delete header;
 }
 
-bool StorageIO::open(bool bWriteAccess, bool bCreate)
+bool StorageIO::open(bool bWriteAccess, bool bCreate, int flags, uint64 expectedSize)
 {
   // already opened ? close first
   if (opened)
       close();
+  openFlags = flags;
+  transacted = (flags & Storage::Transacted) != 0;
   if (bCreate)
   {
-      create();
+      // 512-byte sectors make a version 3 file, 4096-byte ones version 4
+      header->b_shift = (flags & Storage::LargeSectors) ? 12 : 9;
+      bbat->blockSize = (uint64) 1 << header->b_shift;
+      dirtree->clear(bbat->blockSize);
+      dirtree->setWideSizes(header->b_shift > 9);
+      create(expectedSize);
       init();
       writeable = true;
   }
   else
   {
       writeable = bWriteAccess;
-      load(bWriteAccess);
+      load(bWriteAccess, flags);
   }
   
   return result == Storage::Ok;
 }
 
-void StorageIO::load(bool bWriteAccess)
+void StorageIO::load(bool bWriteAccess, int flags)
 {
-  unsigned char* buffer = 0;
-  uint64 buflen = 0;
-  std::vector<uint64> blocks;
-  
   // open the file, check for error
   result = Storage::OpenFailed;
 
-#if defined(POLE_USE_UTF16_FILENAMES)
-  if (bWriteAccess)
-      file.open(UTF8toUTF16(filename).c_str(), std::ios::binary | std::ios::in | std::ios::out);
-  else
-      file.open(UTF8toUTF16(filename).c_str(), std::ios::binary | std::ios::in);
-#else
-  if (bWriteAccess)
-      file.open(filename.c_str(), std::ios::binary | std::ios::in | std::ios::out);
+  fd = openFile(filename, bWriteAccess, false);
+  if( fd < 0 ) return;
+  writeFailed = false;
+
+  loadTables(flags);
+  reserved = filesize.load();
+  if( result == Storage::Ok )
+    opened = true;
   else
-      file.open(filename.c_str(), std::ios::binary | std::ios::in);
-#endif //defined(POLE_USE_UTF16_FILENAMES) && defined(POLE_WIN)
+  {
+    closeFile(fd);
+    fd = -1;
+  }
+}
+
+// reads header, allocation tables and directory from the file
+void StorageIO::loadTables(int flags)
+{
+  unsigned char* buffer = 0;
+  std::vector<uint64> blocks;
+
+  bbat->clear();
+  sbat->clear();
+  mbatDirty = false;
 
-  if( !file.good() ) return;
-  
   // find size of input file
-  file.seekg(0, std::ios::end );
-  filesize = static_cast<uint64>(file.tellg());
+  filesize = fileSize(fd);
 
   // load header
   buffer = new unsigned char[512];
-  file.seekg( 0 ); 
-  file.read( (char*)buffer, 512 );
-  fileCheck(file);
+  memset( buffer, 0, 512 );
+  readFile( 0, buffer, 512 );
   header->load( buffer );
+  header->dirty = false;
   delete[] buffer;
 
   // check OLE magic id
@@ -1322,40 +2250,34 @@ void StorageIO::load(bool bWriteAccess)
   // important block size
   bbat->blockSize = (uint64) 1 << header->b_shift;
   sbat->blockSize = (uint64) 1 << header->s_shift;
+  dirtree->setWideSizes( header->b_shift > 9 );
   
+  unsigned nthreads = 1;
+  if( flags & Storage::ParallelLoad )
+    nthreads = std::min( std::max( std::thread::hardware_concurrency(), 1u ), (unsigned) LOADTHREADS );
+
+  // the DIFAT is a chain, each of its sectors telling where the next one is
   blocks = getbbatBlocks(true);
   
   // load big bat
-  buflen = static_cast<uint64>(blocks.size())*bbat->blockSize;
-  if( buflen > 0 )
-  {
-    buffer = new unsigned char[ buflen ];  
-    loadBigBlocks( blocks, buffer, buflen );
-    bbat->load( buffer, buflen );
-    delete[] buffer;
-  }  
+  loadTable( bbat, blocks, nthreads );
 
-  // load small bat
-  blocks.clear();
-  blocks = bbat->follow( header->sbat_start );
-  buflen = static_cast<uint64>(blocks.size())*bbat->blockSize;
-  if( buflen > 0 )
+  // Small bat and directory tree. Both depend on the big bat only, so with more
+  // than one thread they are loaded at the same time.
+  if( nthreads > 1 )
   {
-    buffer = new unsigned char[ buflen ];  
-    loadBigBlocks( blocks, buffer, buflen );
-    sbat->load( buffer, buflen );
-    delete[] buffer;
-  }  
-  
-  // load directory tree
-  blocks.clear();
-  blocks = bbat->follow( header->dirent_start );
-  buflen = static_cast<uint64>(blocks.size())*bbat->blockSize;
-  buffer = new unsigned char[ buflen ];  
-  loadBigBlocks( blocks, buffer, buflen );
-  dirtree->load( buffer, buflen );
-  unsigned sb_start = readU32( buffer + 0x74 );
-  delete[] buffer;
+    std::thread sbatLoader( &StorageIO::loadTable, this, sbat, bbat->follow( header->sbat_start ), 1 );
+    loadDirectory( bbat->follow( header->dirent_start ), flags, nthreads - 1 );
+    sbatLoader.join();
+  }
+  else
+  {
+    loadTable( sbat, bbat->follow( header->sbat_start ), 1 );
+    loadDirectory( bbat->follow( header->dirent_start ), flags, 1 );
+  }
+  DirEntry* root = dirtree->entry( 0 );
+  if( !root ) return;
+  uint64 sb_start = root->start;
   
   // fetch block chain as data for small-files
   sb_blocks = bbat->follow( sb_start ); // small files
@@ -1368,27 +2290,83 @@ void StorageIO::load(bool bWriteAccess)
   dirtree->debug();
 #endif
   
+  // sectors of the file as it is must not be reused until the next commit
+  if( transacted )
+    freezeBlocks();
+
   // so far so good
   result = Storage::Ok;
-  opened = true;
 }
 
-void StorageIO::create() {
+// runs f( first, n ) for consecutive parts of 0 .. count-1, on up to nthreads threads
+static void splitWork( uint64 count, unsigned nthreads, const std::function<void( uint64, uint64 )>& f )
+{
+  uint64 parts = ( count + LOADMINBLOCKS - 1 ) / LOADMINBLOCKS;
+  if( parts > nthreads ) parts = nthreads;
+  if( parts <= 1 )
+  {
+    if( count > 0 ) f( 0, count );
+    return;
+  }
+  uint64 per = ( count + parts - 1 ) / parts;
+  std::vector<std::thread> threads;
+  for( uint64 first = per; first < count; first += per )
+    threads.push_back( std::thread( f, first, std::min( per, count - first ) ) );
+  f( 0, per );
+  for( unsigned t = 0; t < threads.size(); t++ )
+    threads[t].join();
+}
+
+// reads an allocation table from its sectors; each thread decodes the sectors it read
+void StorageIO::loadTable( AllocTable* table, const std::vector<uint64>& blocks, unsigned nthreads )
+{
+  if( blocks.empty() ) return;
+  uint64 bs = bbat->blockSize;
+  table->resize( blocks.size() * bs / 4 );
+  splitWork( blocks.size(), nthreads, [&]( uint64 first, uint64 n )
+  {
+    std::vector<unsigned char> buffer( n * bs );
+    loadBigBlocks( std::vector<uint64>( blocks.begin() + first, blocks.begin() + first + n ), &buffer[0], buffer.size() );
+    table->load( &buffer[0], first * bs / 4, n * bs / 4 );
+  } );
+}
+
+// reads the directory from its sectors, or prepares to read them when needed
+void StorageIO::loadDirectory( const std::vector<uint64>& blocks, int flags, unsigned nthreads )
+{
+  if( flags & Storage::LazyDirectory )
+  {
+    dirtree->loadLazily( this, blocks, bbat->blockSize );
+    return;
+  }
+  uint64 bs = bbat->blockSize;
+  std::vector<unsigned char> buffer( blocks.size() * bs );
+  splitWork( blocks.size(), nthreads, [&]( uint64 first, uint64 n )
+  {
+    loadBigBlocks( std::vector<uint64>( blocks.begin() + first, blocks.begin() + first + n ), &buffer[first * bs], n * bs );
+  } );
+  dirtree->load( buffer.empty() ? 0 : &buffer[0], buffer.size() );
+}
+
+void StorageIO::create(uint64 expectedSize) {
   // std::cout << "Creating " << filename << std::endl; 
   
-#if defined(POLE_USE_UTF16_FILENAMES)
-  file.open(UTF8toUTF16(filename).c_str(), std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
-#else
-  file.open( filename.c_str(), std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
-#endif
-  if( !file.good() )
+  fd = openFile(filename, true, true);
+  if( fd < 0 )
   {
     std::cerr << "Can't create " << filename << std::endl;
     result = Storage::OpenFailed;
     return;
   }
   
+  // disk space for the whole file right away, if its size is known
+  if( expectedSize > 0 )
+    preallocFile(fd, 0, expectedSize);
+  reserved = expectedSize;
+
   // so far so good
+  filesize = 0;
+  writeFailed = false;
   opened = true;
   result = Storage::Ok;
 }
@@ -1401,8 +2379,9 @@ void StorageIO::init()
     header->sbat_start = 2;
     header->num_bat = 1;
     header->num_sbat = 1;
+    header->num_dirent = (header->b_shift > 9) ? 1 : 0;
     header->dirty = true;
-    bbat->set(0, AllocTable::Eof);
+    bbat->set(0, AllocTable::Bat);
     bbat->markAsDirty(0, bbat->blockSize);
     bbat->set(1, AllocTable::Eof);
     bbat->markAsDirty(1, bbat->blockSize);
@@ -1416,15 +2395,127 @@ void StorageIO::init()
 
 void StorageIO::flush()
 {
-    if (header->dirty)
+    counters.add(IoCounters::Flushes);
     {
-        unsigned char *buffer = new unsigned char[512];
-        header->save( buffer );
-        file.seekp( 0 ); 
-        file.write( (char*)buffer, 512 );
-        fileCheck(file);
-        delete[] buffer;
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        opsSinceFlush = 0;
+        bytesSinceFlush = 0;
+        lastFlush = time(0);
+    }
+    {
+        std::lock_guard<std::mutex> streamsLock(streamsMutex);
+        std::multimap<uint64, StreamIO*>::iterator it;
+        for (it = streams.begin(); it != streams.end(); ++it)
+            it->second->mergeWrites();
+    }
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (transacted)
+    {
+        // the data went to sectors of its own, the rest waits for commit()
+        return;
+    }
+    if (header->dirty && !saveHeader())
+        writeFailed = true;
+    flushTables();
+    padFile(false);
+
+  /* Note on Microsoft implementation:
+     - directory entries are stored in the last block(s)
+     - BATs are as second to the last
+     - Meta BATs are third to the last  
+  */
+}
+
+// writes the header, which takes the whole first sector: with 4096-byte
+// sectors, the rest of it is zeroed
+bool StorageIO::saveHeader()
+{
+    std::vector<unsigned char> buffer(bbat->blockSize, 0);
+    header->save(&buffer[0]);
+    return writeFile(0, &buffer[0], bbat->blockSize) == bbat->blockSize;
+}
+
+// Reserves disk space before the file is written up to end, in pieces as large as
+// what is reserved already (within PREALLOCMIN and PREALLOCMAX), so that a growing
+// file takes a few large extents of the disk rather than one per write. The sectors
+// there are simply past the end of the allocation table, which makes them unused.
+void StorageIO::reserveSpace(uint64 end)
+{
+    if (end <= reserved)
+        return;
+    std::lock_guard<std::mutex> lock(reserveMutex);
+    uint64 from = reserved;
+    if (end <= from)
+        return;
+    uint64 step = from;
+    if (step < PREALLOCMIN)
+        step = PREALLOCMIN;
+    if (step > PREALLOCMAX)
+        step = PREALLOCMAX;
+    preallocFile(fd, from, end + step - from);
+    reserved = end + step;
+}
+
+// Makes the file end with the last sector in use, kept for snapshots or written
+// to, so that it holds whole sectors only. Streams may still be written meanwhile,
+// so the file only grows here; with bRelease, when that is over, it is cut to
+// exactly that size, which also gives back the disk space reserved past it.
+void StorageIO::padFile(bool bRelease)
+{
+    uint64 last = bbat->count();
+    while (last > 0 && (*bbat)[last-1] == AllocTable::Avail && !bbat->isFrozen(last-1))
+        last--;
+    uint64 end = (last + 1) * bbat->blockSize;
+    uint64 written = (filesize + bbat->blockSize - 1) / bbat->blockSize * bbat->blockSize;
+    if (end < written)
+        end = written;
+    if (bRelease)
+    {
+        if (!setFileSize(fd, end))
+            writeFailed = true;
+        filesize = end;
+        reserved = end;
+        return;
+    }
+    if (end > filesize && !growFile(fd, end))
+        writeFailed = true;
+    uint64 size = filesize;
+    while (size < end && !filesize.compare_exchange_weak(size, end))
+        ;
+}
+
+// called after each change (write, size change, creation, deletion) which
+// wrote bytes, flushes if the policy asks for it
+void StorageIO::changed(uint64 bytes)
+{
+    bool bFlush = false;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        opsSinceFlush++;
+        bytesSinceFlush += bytes;
+        uint64 amount = flushAmount ? flushAmount : 1;
+        switch (flushPolicy)
+        {
+        case Storage::FlushEveryOps:
+            bFlush = opsSinceFlush >= amount;
+            break;
+        case Storage::FlushEveryBytes:
+            bFlush = bytesSinceFlush >= amount;
+            break;
+        case Storage::FlushEverySeconds:
+            bFlush = static_cast<uint64>(difftime(time(0), lastFlush)) >= amount;
+            break;
+        default:
+            break;
+        }
     }
+    if (bFlush)
+        flush();
+}
+
+// writes whatever changed in the allocation tables and the directory
+void StorageIO::flushTables()
+{
     if (bbat->isDirty())
         flushbbat();
     if (sbat->isDirty())
@@ -1442,9 +2533,11 @@ void StorageIO::flush()
     {
         uint64 nBytes = bbat->blockSize * static_cast<uint64>(mbat_blocks.size());
         unsigned char *buffer = new unsigned char[nBytes];
+        memset(buffer, 0xff, nBytes);
+        writeU32(buffer + nBytes - 4, AllocTable::Eof);
         uint64 sIdx = 0;
         uint64 dcount = 0;
-        uint64 blockCapacity = bbat->blockSize / sizeof(uint64) - 1;
+        uint64 blockCapacity = bbat->blockSize / sizeof(uint32) - 1; //the last entry links to the next block
         uint64 blockIdx = 0;
         for (unsigned mdIdx = 0; mdIdx < mbat_data.size(); mdIdx++)
         {
@@ -1466,26 +2559,198 @@ void StorageIO::flush()
         delete[] buffer;
         mbatDirty = false;
     }
-    file.flush();
-    fileCheck(file);
+}
 
-  /* Note on Microsoft implementation:
-     - directory entries are stored in the last block(s)
-     - BATs are as second to the last
-     - Meta BATs are third to the last  
-  */
+// Makes the changes since the last commit part of the file. Sectors the file
+// refers to are never overwritten in transacted mode, so the tables which
+// changed are moved to new sectors and written there first. Only then the
+// header is switched over to them, with a single sector write.
+bool StorageIO::commit()
+{
+    if (!opened || !writeable)
+        return false;
+    flush();
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (!transacted)
+        return !writeFailed;
+
+    // all entries of the directory sectors to be written must be known
+    dirtree->loadAll();
+
+    std::vector<uint64> blocks = bbat->follow(header->dirent_start);
+    for (uint64 k = 0; k < blocks.size(); k++)
+        if (dirtree->isDirtyBlock(k) && bbat->isFrozen(blocks[k]))
+            copyOnWrite(&blocks, k, false);
+    if (blocks.size() > 0)
+        header->dirent_start = blocks[0];
+
+    blocks = bbat->follow(header->sbat_start);
+    for (uint64 k = 0; k < blocks.size(); k++)
+        if (sbat->isDirtyBlock(k) && bbat->isFrozen(blocks[k]))
+            copyOnWrite(&blocks, k, false);
+    if (blocks.size() > 0)
+        header->sbat_start = blocks[0];
+
+    // moving a sector of the big block table or of its meta blocks changes
+    // the table again, so this goes on until none of them is moved anymore
+    uint64 perBlock = bbat->blockSize / sizeof(uint32);
+    bool bMoved = true;
+    while (bMoved)
+    {
+        bMoved = false;
+        blocks = getbbatBlocks(false);
+        for (uint64 k = 0; k < blocks.size(); k++)
+        {
+            if (!bbat->isDirtyBlock(k) || !bbat->isFrozen(blocks[k]))
+                continue;
+            uint64 newIdx = bbat->unused();
+            bbat->set(newIdx, AllocTable::Bat);
+            bbat->markAsDirty(newIdx, bbat->blockSize);
+            bbat->set(blocks[k], AllocTable::Avail);
+            bbat->markAsDirty(blocks[k], bbat->blockSize);
+            if (k < 109)
+                header->bb_blocks[k] = newIdx;
+            else
+            {
+                mbat_data[k - 109] = newIdx;
+                mbatDirty = true;
+            }
+            while (newIdx / perBlock >= header->num_bat)
+                addbbatBlock();
+            bMoved = true;
+        }
+        if (!mbatDirty)
+            continue;
+        for (uint64 k = 0; k < mbat_blocks.size(); k++)
+        {
+            if (!bbat->isFrozen(mbat_blocks[k]))
+                continue;
+            uint64 newIdx = bbat->unused();
+            bbat->set(newIdx, AllocTable::MetaBat);
+            bbat->markAsDirty(newIdx, bbat->blockSize);
+            bbat->set(mbat_blocks[k], AllocTable::Avail);
+            bbat->markAsDirty(mbat_blocks[k], bbat->blockSize);
+            mbat_blocks[k] = newIdx;
+            if (k == 0)
+                header->mbat_start = newIdx;
+            while (newIdx / perBlock >= header->num_bat)
+                addbbatBlock();
+            bMoved = true;
+        }
+    }
+
+    flushTables();
+    padFile(false);
+    bool ok = !writeFailed && syncFile(fd);
+
+    ok = ok && saveHeader();
+    ok = ok && syncFile(fd);
+
+    // sectors freed since the last commit can be used again
+    freezeBlocks();
+    return ok;
+}
+
+// Big blocks in use now are not reused until the next commit. Neither are those of
+// earlier commits which snapshots still read; once the last of these snapshots is
+// gone, its blocks are given out again after the next commit.
+void StorageIO::freezeBlocks()
+{
+    bbat->freeze();
+    if (committed)
+        pinned.push_back(committed);
+    committed.reset();
+    std::list<std::weak_ptr<std::vector<char> > >::iterator it = pinned.begin();
+    while (it != pinned.end())
+    {
+        std::shared_ptr<std::vector<char> > blocks = it->lock();
+        if (!blocks)
+        {
+            it = pinned.erase(it);
+            continue;
+        }
+        bbat->keep(*blocks);
+        ++it;
+    }
+}
+
+// Opens view as a read-only storage of the file as it was at the last commit. The
+// blocks it reads are kept from reuse as long as view exists, so it goes on showing
+// that version whatever is committed meanwhile, without locking this storage.
+bool StorageIO::snapshot(StorageIO* view)
+{
+    if (!opened || (writeable && !transacted))
+        return false;
+    std::lock_guard<std::recursive_mutex> lock(mutex);
+    if (writeable)
+    {
+        if (!committed)
+            committed.reset(new std::vector<char>(bbat->frozenBlocks()));
+        view->version = committed;
+    }
+    return view->open(false, false, openFlags & Storage::LazyDirectory);
+}
+
+// throws away all changes since the last commit
+void StorageIO::revert()
+{
+    if (!opened || !transacted)
+        return;
+    std::lock_guard<std::mutex> streamsLock(streamsMutex);
+    std::multimap<uint64, StreamIO*>::iterator it;
+    for (it = streams.begin(); it != streams.end(); ++it)
+        it->second->dropWrites();
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        uint64 b_shift = header->b_shift;
+        std::vector<uint32> generations = dirtree->nextGenerations();
+        loadTables(openFlags);
+        if (result != Storage::Ok)
+        {
+            // created, but never committed: start over with an empty storage
+            *header = Header();
+            header->b_shift = b_shift;
+            bbat->blockSize = (uint64) 1 << b_shift;
+            dirtree->setWideSizes(b_shift > 9);
+            dirtree->clear(bbat->blockSize);
+            bbat->clear();
+            sbat->clear();
+            mbat_blocks.clear();
+            mbat_data.clear();
+            init();
+            result = Storage::Ok;
+        }
+        dirtree->setGenerations(generations);
+    }
+    for (it = streams.begin(); it != streams.end(); ++it)
+        it->second->reload();
 }
 
 void StorageIO::close()
 {
   if( !opened ) return;
-  
-  file.close(); 
+
+  if( writeable && flushPolicy != Storage::FlushManual )
+    flush();
+
+  // streams stay usable objects, but lose their storage
+  {
+    std::lock_guard<std::mutex> streamsLock( streamsMutex );
+    std::multimap<uint64, StreamIO*>::iterator it;
+    for( it = streams.begin(); it != streams.end(); ++it )
+    {
+      it->second->mergeWrites();
+      it->second->io = 0;
+    }
+    streams.clear();
+  }
+
+  std::lock_guard<std::recursive_mutex> lock( mutex );
+  if( writeable )
+    padFile(true);
+  closeFile(fd);
+  fd = -1;
   opened = false;
-  
-  std::list<Stream*>::iterator it;
-  for( it = streams.begin(); it != streams.end(); ++it )
-    delete *it;
 }
 
 
@@ -1495,106 +2760,194 @@ StreamIO* StorageIO::streamIO( const std::string& name, bool bCreate, int64 stre
   if( !name.length() ) return (StreamIO*)0;
 
   // search in the entries
-  DirEntry* entry = dirtree->entry( name, bCreate, bbat->blockSize, this, streamSize );
-  //if( entry) std::cout << "FOUND\n";
-  if( !entry ) return (StreamIO*)0;
-  //if( !entry->dir ) std::cout << "  NOT DIR\n";
-  if( entry->dir ) return (StreamIO*)0;
+  uint64 index;
+  {
+    std::lock_guard<std::recursive_mutex> lock( mutex );
+    DirEntry* entry = dirtree->entry( name, bCreate, bbat->blockSize, this, streamSize );
+    //if( entry) std::cout << "FOUND\n";
+    if( !entry ) return (StreamIO*)0;
+    //if( !entry->dir ) std::cout << "  NOT DIR\n";
+    if( entry->dir ) return (StreamIO*)0;
+    index = dirtree->indexOf( entry );
+  }
 
-  StreamIO* result2 = new StreamIO( this, entry );
+  StreamIO* result2 = new StreamIO( this, index );
   result2->fullName = name;
+  if( bCreate ) changed( 0 );
   
   return result2;
 }
 
-bool StorageIO::deleteByName(const std::string& fullName)
+StreamIO* StorageIO::streamIO( uint64 index )
+{
+  {
+    std::lock_guard<std::recursive_mutex> lock( mutex );
+    DirEntry* entry = dirtree->entry( index );
+    if( !entry || !entry->valid || entry->dir ) return (StreamIO*)0;
+  }
+
+  // the full name is only looked up if someone asks for it, see Stream::fullName
+  return new StreamIO( this, index );
+}
+
+bool StorageIO::deleteByName(const std::string& fullName)
 {
     if (!fullName.length())
         return false;
     if (!writeable)
         return false;
-    DirEntry* entry = dirtree->entry(fullName);
-    if (!entry)
+    bool retVal;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        DirEntry* entry = dirtree->entry(fullName);
+        if (!entry)
+            return false;
+        uint64 parentIdx;
+        uint64 sibIdx;
+        dirtree->findParentAndSib(dirtree->indexOf(entry), fullName, parentIdx, sibIdx);
+        retVal = deleteEntry(entry, parentIdx);
+    }
+    if (retVal)
+        changed(0);
+    return retVal;
+}
+
+// the caller holds mutex, and calls changed() afterwards
+bool StorageIO::deleteEntry(DirEntry *entry, uint64 parentIdx)
+{
+    if (!writeable)
         return false;
+    if (dirtree->indexOf(entry) <= 0)
+        return false; // the root entry cannot be deleted
     bool retVal;
     if (entry->dir)
-        retVal = deleteNode(entry, fullName);
+        retVal = deleteNode(entry, parentIdx);
     else
-        retVal = deleteLeaf(entry, fullName);
-    if (retVal)
-        flush();
+        retVal = deleteLeaf(entry, parentIdx);
     return retVal;
 }
 
-bool StorageIO::deleteNode(DirEntry *entry, const std::string& fullName)
+bool StorageIO::createEntries(const std::vector<std::string>& names, const std::vector<uint64>& sizes, std::vector<uint64>* indexes)
 {
-    std::string lclName = fullName;
-    if (lclName[lclName.size()-1] != '/')
-        lclName += '/';
+    if (!writeable)
+        return false;
+    bool ok = true;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        std::vector<uint64> created = dirtree->createEntries(names, sizes, bbat->blockSize);
+        if (indexes)
+            *indexes = created;
+        reserveDirectory(dirtree->entryCount());
+
+        // reserve the sectors of new streams right away, so that writing them
+        // does not have to extend their chains block by block
+        for (uint64 i = 0; i < created.size(); i++)
+        {
+            DirEntry* e = dirtree->entry(created[i]);
+            if (!e)
+            {
+                ok = false;
+                continue;
+            }
+            if (e->dir || e->size == 0 || e->start != AllocTable::Eof)
+                continue;
+            std::vector<uint64> chain;
+            if (e->size >= header->threshold)
+            {
+                uint64 n = (e->size + bbat->blockSize - 1) / bbat->blockSize;
+                chain.reserve(n);
+                while (chain.size() < n)
+                    ExtendFile(&chain);
+            }
+            else
+            {
+                uint64 n = (e->size + sbat->blockSize - 1) / sbat->blockSize;
+                chain.reserve(n);
+                while (chain.size() < n)
+                    ExtendSmallFile(&chain);
+            }
+            e = dirtree->entry(created[i]);
+            e->start = static_cast<uint32>(chain[0]);
+            dirtree->markAsDirty(created[i], bbat->blockSize);
+        }
+    }
+    changed(0);
+    return ok;
+}
+
+bool StorageIO::deleteNode(DirEntry *entry, uint64 parentIdx)
+{
+    uint64 index = dirtree->indexOf(entry);
     bool retVal = true;
     while (entry->child && entry->child < dirtree->entryCount())
     {
         DirEntry* childEnt = dirtree->entry(entry->child);
-        std::string childFullName = lclName + childEnt->name;
         if (childEnt->dir)
-            retVal = deleteNode(childEnt, childFullName);
+            retVal = deleteNode(childEnt, index);
         else
-            retVal = deleteLeaf(childEnt, childFullName);
+            retVal = deleteLeaf(childEnt, index);
         if (!retVal)
             return false;
     }
-    dirtree->deleteEntry(entry, fullName, bbat->blockSize);
+    dirtree->deleteEntry(entry, parentIdx, bbat->blockSize);
     return retVal;
 }
 
-bool StorageIO::deleteLeaf(DirEntry *entry, const std::string& fullName)
+bool StorageIO::deleteLeaf(DirEntry *entry, uint64 parentIdx)
 {
-    std::vector<uint64> blocks;
-    if (entry->size >= header->threshold)
-    {
-        blocks = bbat->follow(entry->start);
-        for (unsigned idx = 0; idx < blocks.size(); idx++)
-        {
-            bbat->set(blocks[idx], AllocTable::Avail);
-            bbat->markAsDirty(idx, bbat->blockSize);
-        }
-    }
-    else
-    {
-        blocks = sbat->follow(entry->start);
-        for (unsigned idx = 0; idx < blocks.size(); idx++)
-        {
-            sbat->set(blocks[idx], AllocTable::Avail);
-            sbat->markAsDirty(idx, bbat->blockSize);
-        }
-    }
-    dirtree->deleteEntry(entry, fullName, bbat->blockSize);
+    AllocTable* table = (entry->size >= header->threshold) ? bbat : sbat;
+    freeChain(table, table->follow(entry->start), 0);
+    dirtree->deleteEntry(entry, parentIdx, bbat->blockSize);
     return true;
 }
 
+// readAt and writeAt, counted for Storage::ioStats()
+uint64 StorageIO::readFile( uint64 pos, unsigned char* data, uint64 len )
+{
+  uint64 got = readAt( fd, pos, data, len );
+  counters.access( pos, len );
+  counters.add( IoCounters::Reads );
+  counters.add( IoCounters::BytesRead, got );
+  return got;
+}
+
+uint64 StorageIO::writeFile( uint64 pos, const unsigned char* data, uint64 len )
+{
+  uint64 put = writeAt( fd, pos, data, len );
+  counters.access( pos, len );
+  counters.add( IoCounters::Writes );
+  counters.add( IoCounters::BytesWritten, put );
+  return put;
+}
+
 uint64 StorageIO::loadBigBlocks( std::vector<uint64> blocks,
   unsigned char* data, uint64 maxlen )
 {
   // sentinel
   if( !data ) return 0;
-  fileCheck(file);
-  if( !file.good() ) return 0;
+  if( fd < 0 ) return 0;
   if( blocks.size() < 1 ) return 0;
   if( maxlen == 0 ) return 0;
 
-  // read block one by one, seems fast enough
+  // blocks which follow each other in the file are read at once
   uint64 bytes = 0;
-  for( unsigned int i=0; (i < blocks.size() ) & ( bytes<maxlen ); i++ )
+  uint64 i = 0;
+  while( ( i < blocks.size() ) && ( bytes < maxlen ) )
   {
-    uint64 block = blocks[i];
-    uint64 pos =  bbat->blockSize * ( block+1 );
-    uint64 p = (bbat->blockSize < maxlen-bytes) ? bbat->blockSize : maxlen-bytes;
-    if( pos + p > filesize )
-        p = filesize - pos;
-    file.seekg( pos );
-    file.read( (char*)data + bytes, p );
-    fileCheck(file);
-    // should use gcount to see how many bytes were really returned - eof check...
+    uint64 run = 1;
+    while( run * bbat->blockSize < maxlen-bytes && i + run < blocks.size() && blocks[i+run] == blocks[i+run-1] + 1 )
+      run++;
+    uint64 pos =  bbat->blockSize * ( blocks[i]+1 );
+    uint64 p = (run * bbat->blockSize < maxlen-bytes) ? run * bbat->blockSize : maxlen-bytes;
+    i += run;
+    counters.add( IoCounters::SectorsRead, run );
+    // what lies past the end of the file is allocated, but not written yet,
+    // so it comes back as zeros, as does anything the file could not give
+    uint64 size = filesize;
+    uint64 avail = ( pos >= size ) ? 0 : ( pos + p > size ) ? size - pos : p;
+    uint64 got = avail ? readFile( pos, data + bytes, avail ) : 0;
+    if( got < p )
+        memset( data + bytes + got, 0, p - got );
     bytes += p;
   }
 
@@ -1606,8 +2959,7 @@ uint64 StorageIO::loadBigBlock( uint64 block,
 {
   // sentinel
   if( !data ) return 0;
-  fileCheck(file);
-  if( !file.good() ) return 0;
+  if( fd < 0 ) return 0;
   
   // wraps call for loadBigBlocks
   std::vector<uint64> blocks;
@@ -1617,33 +2969,42 @@ uint64 StorageIO::loadBigBlock( uint64 block,
   return loadBigBlocks( blocks, data, maxlen );
 }
 
-uint64 StorageIO::saveBigBlocks( std::vector<uint64> blocks, uint64 offset, unsigned char* data, uint64 len )
+uint64 StorageIO::saveBigBlocks( const std::vector<uint64>& blocks, uint64 offset, unsigned char* data, uint64 len, uint64 startAtBlock )
 {
   // sentinel
   if( !data ) return 0;
-  fileCheck(file);
-  if( !file.good() ) return 0;
+  if( fd < 0 ) return 0;
   if( blocks.size() < 1 ) return 0;
   if( len == 0 ) return 0;
 
-  // write block one by one, seems fast enough
+  // blocks which follow each other in the file are written in one go
   uint64 bytes = 0;
-  for( unsigned int i=0; (i < blocks.size() ) & ( bytes<len ); i++ )
+  uint64 i = startAtBlock;
+  while( ( i < blocks.size() ) && ( bytes < len ) )
   {
-    uint64 block = blocks[i];
-    uint64 pos =  (bbat->blockSize * ( block+1 ) ) + offset;
+    uint64 run = 1;
     uint64 maxWrite = bbat->blockSize - offset;
+    while( maxWrite < len - bytes && i + run < blocks.size() && blocks[i+run] == blocks[i+run-1] + 1 )
+    {
+      maxWrite += bbat->blockSize;
+      run++;
+    }
+    uint64 pos =  (bbat->blockSize * ( blocks[i]+1 ) ) + offset;
     uint64 tobeWritten = len - bytes;
     if (tobeWritten > maxWrite)
         tobeWritten = maxWrite;
-    file.seekp( pos );
-    file.write( (char*)data + bytes, tobeWritten );
-    fileCheck(file);
+    reserveSpace(pos + tobeWritten);
+    if (writeFile( pos, data + bytes, tobeWritten ) != tobeWritten)
+        writeFailed = true;
 
     bytes += tobeWritten;
     offset = 0;
-    if (filesize < pos + tobeWritten)
-        filesize = pos + tobeWritten;
+    i += run;
+    counters.add( IoCounters::SectorsWritten, run );
+    uint64 end = pos + tobeWritten;
+    uint64 size = filesize;
+    while (size < end && !filesize.compare_exchange_weak(size, end))
+        ;
   }
 
   return bytes;
@@ -1653,8 +3014,7 @@ uint64 StorageIO::saveBigBlocks( std::vector<uint64> blocks, uint64 offset, unsi
 uint64 StorageIO::saveBigBlock( uint64 block, uint64 offset, unsigned char* data, uint64 len )
 {
     if ( !data ) return 0;
-    fileCheck(file);
-    if ( !file.good() ) return 0;
+    if ( fd < 0 ) return 0;
     //wrap call for saveBigBlocks
     std::vector<uint64> blocks;
     blocks.resize( 1 );
@@ -1668,8 +3028,7 @@ uint64 StorageIO::loadSmallBlocks( std::vector<uint64> blocks,
 {
   // sentinel
   if( !data ) return 0;
-  fileCheck(file);
-  if( !file.good() ) return 0;
+  if( fd < 0 ) return 0;
   if( blocks.size() < 1 ) return 0;
   if( maxlen == 0 ) return 0;
 
@@ -1678,6 +3037,7 @@ uint64 StorageIO::loadSmallBlocks( std::vector<uint64> blocks,
 
   // read small block one by one
   uint64 bytes = 0;
+  uint64 loaded = sb_blocks.size();
   for( unsigned int i=0; ( i<blocks.size() ) & ( bytes<maxlen ); i++ )
   {
     uint64 block = blocks[i];
@@ -1687,7 +3047,12 @@ uint64 StorageIO::loadSmallBlocks( std::vector<uint64> blocks,
     uint64 bbindex = pos / bbat->blockSize;
     if( bbindex >= sb_blocks.size() ) break;
 
-    loadBigBlock( sb_blocks[ bbindex ], buf, bbat->blockSize );
+    // neighbouring small blocks often share their big block
+    if( bbindex != loaded )
+    {
+      loadBigBlock( sb_blocks[ bbindex ], buf, bbat->blockSize );
+      loaded = bbindex;
+    }
 
     // copy the data
     uint64 offset = pos % bbat->blockSize;
@@ -1695,6 +3060,7 @@ uint64 StorageIO::loadSmallBlocks( std::vector<uint64> blocks,
     p = (sbat->blockSize<p ) ? sbat->blockSize : p;
     memcpy( data + bytes, buf + offset, p );
     bytes += p;
+    counters.add( IoCounters::MiniSectorsRead );
   }
   
   delete[] buf;
@@ -1707,8 +3073,7 @@ uint64 StorageIO::loadSmallBlock( uint64 block,
 {
   // sentinel
   if( !data ) return 0;
-  fileCheck(file);
-  if( !file.good() ) return 0;
+  if( fd < 0 ) return 0;
 
   // wraps call for loadSmallBlocks
   std::vector<uint64> blocks;
@@ -1719,44 +3084,69 @@ uint64 StorageIO::loadSmallBlock( uint64 block,
 }
 
 
-uint64 StorageIO::saveSmallBlocks( std::vector<uint64> blocks, uint64 offset, 
+uint64 StorageIO::saveSmallBlocks( const std::vector<uint64>& blocks, uint64 offset, 
                                         unsigned char* data, uint64 len, int64 startAtBlock )
 {
   // sentinel
   if( !data ) return 0;
-  fileCheck(file);
-  if( !file.good() ) return 0;
+  if( fd < 0 ) return 0;
   if( blocks.size() < 1 ) return 0;
   if( len == 0 ) return 0;
 
-  // write block one by one, seems fast enough
+  // Small blocks live inside the big blocks of sb_blocks. The big blocks touched
+  // are patched in memory, each read and written once, and big blocks which follow
+  // each other in the file are written together.
+  uint64 perBlock = bbat->blockSize / sbat->blockSize;
+  std::vector<uint64> run;           // consecutive big blocks, not written yet
+  std::vector<unsigned char> buf;    // and their contents
   uint64 bytes = 0;
   for( uint64 i = startAtBlock; (i < blocks.size() ) & ( bytes<len ); i++ )
   {
     uint64 block = blocks[i];
-     // find where the small-block exactly is
-    uint64 pos = block * sbat->blockSize;
-    uint64 bbindex = pos / bbat->blockSize;
+    uint64 bbindex = block / perBlock;
     if( bbindex >= sb_blocks.size() ) break;
-    uint64 offset2 = pos % bbat->blockSize;
+    uint64 bigBlock = sb_blocks[ bbindex ];
+    uint64 source = bigBlock;
+    if( transacted && bbat->isFrozen( bigBlock ) )
+    {
+      // the old contents are read below, no need to copy them
+      bigBlock = copyOnWrite( &sb_blocks, bbindex, false );
+      if( bbindex == 0 )
+      {
+        dirtree->entry( 0 )->start = static_cast<uint32>( bigBlock );
+        dirtree->markAsDirty( 0, bbat->blockSize );
+      }
+    }
+    if( run.size() && ( bigBlock < run[0] || bigBlock > run.back() + 1 ) )
+    {
+      // not part of the pending run, nor next to it
+      saveBigBlocks( run, 0, &buf[0], buf.size() );
+      run.clear();
+    }
+    if( run.empty() || bigBlock == run.back() + 1 )
+    {
+      buf.resize( ( run.size() + 1 ) * bbat->blockSize );
+      loadBigBlock( source, &buf[ run.size() * bbat->blockSize ], bbat->blockSize );
+      run.push_back( bigBlock );
+    }
     uint64 maxWrite = sbat->blockSize - offset;
     uint64 tobeWritten = len - bytes;
     if (tobeWritten > maxWrite)
         tobeWritten = maxWrite;
-    saveBigBlock( sb_blocks[ bbindex ], offset2 + offset, data + bytes, tobeWritten);
+    uint64 dest = ( bigBlock - run[0] ) * bbat->blockSize + ( block % perBlock ) * sbat->blockSize + offset;
+    memcpy( &buf[dest], data + bytes, tobeWritten );
     bytes += tobeWritten;
     offset = 0;
-    if (filesize < pos + tobeWritten)
-        filesize = pos + tobeWritten;
   }
+  if( run.size() )
+    saveBigBlocks( run, 0, &buf[0], buf.size() );
   return bytes;
 }
 
 uint64 StorageIO::saveSmallBlock( uint64 block, uint64 offset, unsigned char* data, uint64 len )
 {
     if ( !data ) return 0;
-    fileCheck(file);
-    if ( !file.good() ) return 0;
+    if ( fd < 0 ) return 0;
     //wrap call for saveSmallBlocks
     std::vector<uint64> blocks;
     blocks.resize( 1 );
@@ -1848,7 +3238,7 @@ uint64 StorageIO::ExtendFile( std::vector<uint64> *chain )
 {
     uint64 newblockIdx = bbat->unused();
     bbat->set(newblockIdx, AllocTable::Eof);
-    uint64 bbidx = newblockIdx / (bbat->blockSize / sizeof(uint64));
+    uint64 bbidx = newblockIdx / (bbat->blockSize / sizeof(uint32));
     while (bbidx >= header->num_bat)
         addbbatBlock();
     bbat->markAsDirty(newblockIdx, bbat->blockSize);
@@ -1861,10 +3251,126 @@ uint64 StorageIO::ExtendFile( std::vector<uint64> *chain )
     return newblockIdx;
 }
 
+uint64 StorageIO::ExtendSmallFile( std::vector<uint64> *chain )
+{
+    uint64 nblock = sbat->unused();
+    if (chain->size() > 0)
+    {
+        sbat->set((*chain)[chain->size()-1], nblock);
+        sbat->markAsDirty((*chain)[chain->size()-1], bbat->blockSize);
+    }
+    sbat->set(nblock, AllocTable::Eof);
+    sbat->markAsDirty(nblock, bbat->blockSize);
+    chain->push_back(nblock);
+    uint64 bbidx = nblock / (bbat->blockSize / sizeof(unsigned int));
+    while (bbidx >= header->num_sbat)
+    {
+        std::vector<uint64> sbat_blocks = bbat->follow(header->sbat_start);
+        ExtendFile(&sbat_blocks);
+        if (header->num_sbat == 0)
+            header->sbat_start = sbat_blocks[0];
+        header->num_sbat++;
+        header->dirty = true; //Header will have to be rewritten
+    }
+    uint64 sidx = nblock * sbat->blockSize / bbat->blockSize;
+    while (sidx >= sb_blocks.size())
+    {
+        ExtendFile(&sb_blocks);
+        dirtree->markAsDirty(0, bbat->blockSize); //make sure to rewrite first directory block
+    }
+    return nblock;
+}
+
+// In transacted mode the sectors the file refers to must stay as they are until
+// the next commit. This gives chain[k] a new sector, linked in place of the old
+// one, copies the old contents over if bCopy is set and returns the new sector.
+uint64 StorageIO::copyOnWrite( std::vector<uint64> *chain, uint64 k, bool bCopy )
+{
+    uint64 oldIdx = (*chain)[k];
+    uint64 newIdx = bbat->unused();
+    bbat->set(newIdx, (k+1 < chain->size()) ? (*chain)[k+1] : AllocTable::Eof);
+    bbat->markAsDirty(newIdx, bbat->blockSize);
+    while (newIdx / (bbat->blockSize / sizeof(uint32)) >= header->num_bat)
+        addbbatBlock();
+    if (k > 0)
+    {
+        bbat->set((*chain)[k-1], newIdx);
+        bbat->markAsDirty((*chain)[k-1], bbat->blockSize);
+    }
+    bbat->set(oldIdx, AllocTable::Avail);
+    bbat->markAsDirty(oldIdx, bbat->blockSize);
+    if (bCopy)
+    {
+        std::vector<unsigned char> buffer(bbat->blockSize);
+        loadBigBlock(oldIdx, &buffer[0], bbat->blockSize);
+        saveBigBlock(newIdx, 0, &buffer[0], bbat->blockSize);
+    }
+    (*chain)[k] = newIdx;
+    return newIdx;
+}
+
+// gives blocks chain[from], chain[from+1], ... back to table and
+// ends the chain before them
+void StorageIO::freeChain( AllocTable* table, const std::vector<uint64>& chain, uint64 from )
+{
+    for (uint64 idx = from; idx < chain.size(); idx++)
+    {
+        table->set(chain[idx], AllocTable::Avail);
+        table->markAsDirty(chain[idx], bbat->blockSize);
+    }
+    if (from > 0 && from < chain.size())
+    {
+        table->set(chain[from-1], AllocTable::Eof);
+        table->markAsDirty(chain[from-1], bbat->blockSize);
+    }
+}
+
+// makes sure the directory chain has room for nEntries entries
+void StorageIO::reserveDirectory( uint64 nEntries )
+{
+    uint64 perBlock = bbat->blockSize / 128;
+    uint64 nBlocks = (nEntries + perBlock - 1) / perBlock;
+    std::vector<uint64> blocks = bbat->follow(header->dirent_start);
+    while (blocks.size() < nBlocks)
+    {
+        ExtendFile(&blocks);
+        dirtree->markAsDirty((blocks.size()-1) * perBlock, bbat->blockSize);
+    }
+    if (header->b_shift > 9 && header->num_dirent != blocks.size())
+    {
+        header->num_dirent = blocks.size();
+        header->dirty = true;
+    }
+}
+
+// takes n unused big blocks for a stream to fill on its own, see StreamIO::growChain;
+// they are marked as ends of chains until the stream links them. They are added to
+// result from the back, so that the lowest is taken first. The allocation table is
+// grown first, so that its new sectors lie below the blocks: those the stream does
+// not use are then at the end of the file, where padFile() cuts them off.
+void StorageIO::reserveBlocks( uint64 n, std::vector<uint64>& result )
+{
+    uint64 perBlock = bbat->blockSize / sizeof(uint32);
+    while (bbat->unusedAfter(n - 1) / perBlock >= header->num_bat)
+        addbbatBlock();
+    std::vector<uint64> reserved(n);
+    for (uint64 i = 0; i < n; i++)
+    {
+        uint64 idx = bbat->unused();
+        bbat->set(idx, AllocTable::Eof);
+        while (idx / perBlock >= header->num_bat)
+            addbbatBlock();
+        bbat->markAsDirty(idx, bbat->blockSize);
+        reserved[n-1-i] = idx;
+    }
+    result.insert(result.begin(), reserved.begin(), reserved.end());
+}
+
 void StorageIO::addbbatBlock()
 {
     uint64 newblockIdx = bbat->unused();
-    bbat->set(newblockIdx, AllocTable::MetaBat);
+    bbat->set(newblockIdx, AllocTable::Bat);
+    bbat->markAsDirty(newblockIdx, bbat->blockSize);
 
     if (header->num_bat < 109)
         header->bb_blocks[header->num_bat] = newblockIdx;
@@ -1873,12 +3379,13 @@ void StorageIO::addbbatBlock()
         mbatDirty = true;
         mbat_data.push_back(newblockIdx);
         uint64 metaIdx = header->num_bat - 109;
-        uint64 idxPerBlock = bbat->blockSize / sizeof(uint64) - 1; //reserve room for index to next block
+        uint64 idxPerBlock = bbat->blockSize / sizeof(uint32) - 1; //reserve room for index to next block
         uint64 idxBlock = metaIdx / idxPerBlock;
         if (idxBlock == mbat_blocks.size())
         {
             uint64 newmetaIdx = bbat->unused();
             bbat->set(newmetaIdx, AllocTable::MetaBat);
+            bbat->markAsDirty(newmetaIdx, bbat->blockSize);
             mbat_blocks.push_back(newmetaIdx);
             if (header->num_mbat == 0)
                 header->mbat_start = newmetaIdx;
@@ -1889,31 +3396,428 @@ void StorageIO::addbbatBlock()
     header->dirty = true;
 }
 
+// =========== asynchronous operations ==========
+
+IoExecutor::IoExecutor()
+:   stopping( false )
+{
+    for( unsigned i = 0; i < IOTHREADS; i++ )
+        threads.push_back( std::thread( &IoExecutor::run, this ) );
+}
+
+// pending operations are done before the threads end
+IoExecutor::~IoExecutor()
+{
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    ready.notify_all();
+    for( unsigned i = 0; i < threads.size(); i++ )
+        threads[i].join();
+}
+
+IoExecutor& IoExecutor::instance()
+{
+    static IoExecutor executor;
+    return executor;
+}
+
+void IoExecutor::post( const std::function<void()>& task )
+{
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        tasks.push_back( task );
+    }
+    ready.notify_one();
+}
+
+void IoExecutor::run()
+{
+    for( ;; )
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            while( tasks.empty() && !stopping )
+                ready.wait( lock );
+            if( tasks.empty() )
+                return;
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+// =========== import of host directories ==========
+
+void ImportQueue::push( ImportChunk* chunk )
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    chunks.push_back( chunk );
+    ready.notify_one();
+}
+
+ImportChunk* ImportQueue::pop()
+{
+    std::unique_lock<std::mutex> lock( mutex );
+    while( chunks.empty() )
+        ready.wait( lock );
+    ImportChunk* chunk = chunks.front();
+    chunks.pop_front();
+    return chunk;
+}
+
+// adds an entry found below the host directory, directories get a trailing slash
+static void addHostEntry( const std::string& storageDir, const std::string& name, bool isDir,
+    uint64 size, const std::string& hostPath, std::vector<std::string>& names,
+    std::vector<uint64>& sizes, std::vector<std::string>& hostPaths )
+{
+    names.push_back( storageDir + name + ( isDir ? "/" : "" ) );
+    sizes.push_back( isDir ? 0 : size );
+    hostPaths.push_back( isDir ? std::string() : hostPath );
+}
+
+// lists everything below hostDir, as storage names below storageDir, the host
+// path of each file (empty for directories) and its size; returns false if a
+// directory or file could not be looked at
+static bool listHostTree( const std::string& hostDir, const std::string& storageDir,
+    std::vector<std::string>& names, std::vector<uint64>& sizes, std::vector<std::string>& hostPaths )
+{
+    bool ok = true;
+    std::vector< std::pair<std::string, std::string> > todo; // host and storage path of directories
+    todo.push_back( std::make_pair( hostDir, storageDir ) );
+    while( !todo.empty() )
+    {
+        std::string dir = todo.back().first;
+        std::string path = todo.back().second;
+        todo.pop_back();
+#ifdef POLE_WIN
+        WIN32_FIND_DATAW ffd;
+        HANDLE h = FindFirstFileW( UTF8toUTF16( dir + "\\*" ).c_str(), &ffd );
+        if( h == INVALID_HANDLE_VALUE )
+        {
+            ok = false;
+            continue;
+        }
+        do
+        {
+            std::string name = UTF16toUTF8( ffd.cFileName );
+            if( name == "." || name == ".." ) continue;
+            std::string hostPath = dir + "\\" + name;
+            if( ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+            {
+                // junctions may lead back up the tree
+                if( ffd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT ) continue;
+                addHostEntry( path, name, true, 0, hostPath, names, sizes, hostPaths );
+                todo.push_back( std::make_pair( hostPath, path + name + "/" ) );
+            }
+            else
+            {
+                uint64 size = ( (uint64)ffd.nFileSizeHigh << 32 ) | ffd.nFileSizeLow;
+                addHostEntry( path, name, false, size, hostPath, names, sizes, hostPaths );
+            }
+        }
+        while( FindNextFileW( h, &ffd ) );
+        FindClose( h );
+#else
+        DIR* d = opendir( dir.c_str() );
+        if( !d )
+        {
+            ok = false;
+            continue;
+        }
+        struct dirent* de;
+        while( ( de = readdir( d ) ) != 0 )
+        {
+            std::string name = de->d_name;
+            if( name == "." || name == ".." ) continue;
+            std::string hostPath = dir + "/" + name;
+            struct stat st;
+            if( lstat( hostPath.c_str(), &st ) != 0 )
+            {
+                ok = false;
+                continue;
+            }
+            // links to files are followed, links to directories may lead back up the tree
+            if( S_ISLNK( st.st_mode ) && ( stat( hostPath.c_str(), &st ) != 0 || S_ISDIR( st.st_mode ) ) )
+                continue;
+            if( S_ISDIR( st.st_mode ) )
+            {
+                addHostEntry( path, name, true, 0, hostPath, names, sizes, hostPaths );
+                todo.push_back( std::make_pair( hostPath, path + name + "/" ) );
+            }
+            else if( S_ISREG( st.st_mode ) )
+                addHostEntry( path, name, false, st.st_size, hostPath, names, sizes, hostPaths );
+        }
+        closedir( d );
+#endif
+    }
+    return ok;
+}
+
+static FILE* openHostFile( const std::string& path )
+{
+#ifdef POLE_USE_UTF16_FILENAMES
+    FILE* f = _wfopen( UTF8toUTF16( path ).c_str(), L"rb" );
+#else
+    FILE* f = fopen( path.c_str(), "rb" );
+#endif
+    // the chunks are big enough, reads go straight into them
+    if( f ) setvbuf( f, 0, _IONBF, 0 );
+    return f;
+}
+
+// runs on its own thread during importTree: reads the files one after the other
+// into chunks taken from empty and passes them on to full, a null chunk ends it
+static void readHostFiles( const std::vector<std::string>* hostPaths, const std::vector<uint64>* files,
+    ImportQueue* empty, ImportQueue* full )
+{
+    ImportChunk* chunk = empty->pop();
+    for( uint64 i = 0; i < files->size(); i++ )
+    {
+        FILE* f = openHostFile( (*hostPaths)[ (*files)[i] ] );
+        uint64 offset = 0;
+        for( ;; )
+        {
+            // pieces are whole 4096 bytes except at the end of a file, so that
+            // the writes of a big stream stay aligned to its sectors
+            uint64 room = ( IMPORTCHUNKSIZE - chunk->used ) & ~(uint64)4095;
+            if( room == 0 )
+            {
+                full->push( chunk );
+                chunk = empty->pop();
+                continue;
+            }
+            ImportPiece piece;
+            piece.file = i;
+            piece.offset = offset;
+            piece.start = chunk->used;
+            piece.len = f ? fread( chunk->data + chunk->used, 1, room, f ) : 0;
+            piece.last = piece.len < room;
+            piece.failed = !f || ( piece.last && ferror( f ) );
+            chunk->used += piece.len;
+            chunk->pieces.push_back( piece );
+            offset += piece.len;
+            if( piece.last ) break;
+        }
+        if( f ) fclose( f );
+    }
+    full->push( chunk );
+    full->push( 0 );
+}
+
+bool StorageIO::importTree(const std::string& hostPath, const std::string& path)
+{
+    if (!writeable)
+        return false;
+
+    std::string dir = path;
+    if (dir.empty() || dir[0] != '/')
+        dir = "/" + dir;
+    if (dir[dir.length()-1] != '/')
+        dir += '/';
+    std::string hostDir = hostPath;
+    while (hostDir.length() > 1 && (hostDir[hostDir.length()-1] == '/' || hostDir[hostDir.length()-1] == '\\'))
+        hostDir.erase(hostDir.length()-1);
+
+    std::vector<std::string> names;
+    std::vector<uint64> sizes;
+    std::vector<std::string> hostPaths;
+    if (dir != "/")
+        addHostEntry("", dir.substr(0, dir.length()-1), true, 0, "", names, sizes, hostPaths);
+    bool ok = listHostTree(hostDir, dir, names, sizes, hostPaths);
+
+    // all streams are created and their sectors reserved in one go, in the
+    // order the files are read in below; if some of them clash with entries
+    // already there, only those are left out
+    std::vector<uint64> indexes;
+    ok = createEntries(names, sizes, &indexes) && ok;
+    if (indexes.size() != names.size())
+        return false;
+    std::vector<uint64> files;
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        std::vector<char> taken(dirtree->entryCount(), 0);
+        for (uint64 i = 0; i < names.size(); i++)
+        {
+            DirEntry* e = dirtree->entry(indexes[i]);
+            if (!e || e->dir != hostPaths[i].empty())
+            {
+                ok = false; // e.g. a stream of that name is in the way of a directory
+                continue;
+            }
+            if (e->dir)
+                continue;
+            if (taken[indexes[i]])
+            {
+                ok = false; // names which differ only in case, or beyond 31 characters
+                continue;
+            }
+            taken[indexes[i]] = 1;
+            files.push_back(i);
+        }
+    }
+
+    // a second thread reads the files while the data read before is written
+    ImportQueue empty, full;
+    std::vector<ImportChunk> chunks(IMPORTCHUNKS);
+    for (uint64 k = 0; k < chunks.size(); k++)
+    {
+        chunks[k].data = new unsigned char[IMPORTCHUNKSIZE];
+        chunks[k].used = 0;
+        empty.push(&chunks[k]);
+    }
+    std::thread reader(readHostFiles, &hostPaths, &files, &empty, &full);
+
+    StreamIO* stream = 0;
+    for (;;)
+    {
+        ImportChunk* chunk = full.pop();
+        if (!chunk)
+            break;
+        for (uint64 j = 0; j < chunk->pieces.size(); j++)
+        {
+            const ImportPiece& piece = chunk->pieces[j];
+            if (!stream)
+                stream = streamIO(indexes[files[piece.file]]);
+            if (!stream)
+                ok = false;
+            else if (piece.len && stream->write(piece.offset, chunk->data + piece.start, piece.len) != piece.len)
+                ok = false;
+            if (piece.last)
+            {
+                if (piece.failed)
+                    ok = false;
+                // the file may have changed since it was listed
+                if (stream && stream->size() != piece.offset + piece.len)
+                    stream->setSize(piece.offset + piece.len);
+                delete stream;
+                stream = 0;
+            }
+        }
+        chunk->used = 0;
+        chunk->pieces.clear();
+        empty.push(chunk);
+    }
+    reader.join();
+    for (uint64 k = 0; k < chunks.size(); k++)
+        delete[] chunks[k].data;
+
+    if (flushPolicy != Storage::FlushManual)
+        flush();
+    return ok;
+}
+
 
 // =========== StreamIO ==========
 
-StreamIO::StreamIO( StorageIO* s, DirEntry* e)
+StreamIO::StreamIO( StorageIO* s, uint64 index )
 :   io(s),
-    entryIdx(io->dirtree->indexOf(e)),
+    entryIdx(index),
     fullName(),
-    blocks(),
     eof(false),
     fail(false),
+    chain(),
+    generation(0),
+    entrySize(0),
+    linked(0),
+    arena(),
+    arenaSize(ARENAMINBLOCKS),
     m_pos(0),
-    cache_data(new unsigned char[CACHEBUFSIZE]),        
+    cache_data(0),         // allocated by the first getch()
     cache_size(0),         // indicating an empty cache
-    cache_pos(0)
+    cache_pos(0),
+    wbuf_data(0),          // allocated with the first write
+    wbuf_size(0),
+    wbuf_pos(0)
 {
-  if( e->size >= io->header->threshold ) 
-    blocks = io->bbat->follow( e->start );
-  else
-    blocks = io->sbat->follow( e->start );
+  std::lock_guard<std::mutex> streamsLock( io->streamsMutex );
+
+  // the chain is followed below, so other streams of the entry must have theirs linked;
+  // if the storage is read-only, theirs is used instead
+  typedef std::multimap<uint64, StreamIO*>::iterator Iterator;
+  std::pair<Iterator, Iterator> others = io->streams.equal_range( entryIdx );
+  for( Iterator it = others.first; it != others.second; ++it )
+    it->second->mergeWrites();
+
+  {
+    std::lock_guard<std::recursive_mutex> lock( io->mutex );
+    DirEntry* e = io->dirtree->entry( entryIdx );
+    generation = io->dirtree->generation( entryIdx );
+    entrySize = e->size;
+    if( !io->writeable && others.first != others.second )
+      chain = others.first->second->chain;
+    else if( e->size >= io->header->threshold ) 
+      chain = std::make_shared<std::vector<uint64> >( io->bbat->follow( e->start ) );
+    else
+      chain = std::make_shared<std::vector<uint64> >( io->sbat->follow( e->start ) );
+    linked = chain->size();
+  }
+  io->streams.insert( std::make_pair( (uint64) entryIdx, this ) );
+}
+
+// another cursor on the stream of source, starting at its position
+StreamIO::StreamIO( StreamIO* source )
+:   io(source->io),
+    entryIdx(source->entryIdx),
+    fullName(source->fullName),
+    eof(false),
+    fail(source->fail),
+    chain(),
+    generation(0),
+    entrySize(0),
+    linked(0),
+    arena(),
+    arenaSize(ARENAMINBLOCKS),
+    m_pos(0),
+    cache_data(0),
+    cache_size(0),
+    cache_pos(0),
+    wbuf_data(0),
+    wbuf_size(0),
+    wbuf_pos(0)
+{
+  std::lock_guard<std::mutex> streamsLock( io->streamsMutex );
+  std::lock_guard<std::recursive_mutex> lock( source->mutex );
+
+  // the shared chain has to be complete, and the data in the file
+  source->mergeWrites();
+  chain = source->chain;
+  generation = source->generation;
+  entrySize = source->entrySize;
+  linked = chain->size();
+  m_pos = source->m_pos;
+  io->streams.insert( std::make_pair( (uint64) entryIdx, this ) );
 }
 
-// FIXME tell parent we're gone
 StreamIO::~StreamIO()
 {
+  if( io )
+  {
+    mergeWrites();
+    std::lock_guard<std::mutex> streamsLock( io->streamsMutex );
+    typedef std::multimap<uint64, StreamIO*>::iterator Iterator;
+    std::pair<Iterator, Iterator> others = io->streams.equal_range( entryIdx );
+    for( Iterator it = others.first; it != others.second; ++it )
+      if( it->second == this )
+      {
+        io->streams.erase( it );
+        break;
+      }
+  }
   delete[] cache_data;  
+  delete[] wbuf_data;
+}
+
+// the chain, for changing it; a shared one is copied first, so that the streams
+// sharing it keep what they had
+std::vector<uint64>& StreamIO::ownChain()
+{
+  if( chain.use_count() > 1 )
+    chain = std::make_shared<std::vector<uint64> >( *chain );
+  return *chain;
 }
 
 void StreamIO::setSize(uint64 newSize)
@@ -1923,6 +3827,12 @@ void StreamIO::setSize(uint64 newSize)
 
     if(!io->writeable )
         return;
+    std::lock_guard<std::recursive_mutex> lock( mutex );
+    // buffered bytes past the new end are dropped
+    if (wbuf_pos + wbuf_size > newSize)
+        wbuf_size = (newSize > wbuf_pos) ? newSize - wbuf_pos : 0;
+    cache_size = 0;
+    std::lock_guard<std::recursive_mutex> ioLock( io->mutex );
     DirEntry *entry = io->dirtree->entry(entryIdx);
     if (newSize >= io->header->threshold && entry->size < io->header->threshold)
     {
@@ -1936,53 +3846,73 @@ void StreamIO::setSize(uint64 newSize)
     }
     if (bThresholdCrossed)
     {
-        // first, read what is already in the stream, limited by the requested new size. Note
-        // that the read can work precisely because we have not yet reset the size.
+        // Move what is already in the stream, limited by the requested new size, straight
+        // from the old blocks into the new ones. This goes one big block at a time, so it
+        // takes no more memory than that, whatever the size of the stream.
+        flushWrites();
+        linkBlocks();
         uint64 len = newSize;
         if (len > entry->size)
             len = entry->size;
-        unsigned char *buffer = 0;
-        uint64 savePos = tell();
-        if (len)
-        {
-            buffer = new unsigned char[len];
-            seek(0);
-            read(buffer, len);
-        }
-        // Now get rid of the existing blocks
-        if (bOver)
+        uint64 bigSize = io->bbat->blockSize;
+        uint64 smallSize = io->sbat->blockSize;
+        const std::vector<uint64>& blocks = *chain;
+        std::vector<unsigned char> buffer(bigSize);
+        std::vector<uint64> newBlocks;
+        for (uint64 pos = 0; pos < len; pos += bigSize)
         {
-            for (unsigned int idx = 0; idx < blocks.size(); idx++)
+            uint64 count = len - pos;
+            if (count > bigSize)
+                count = bigSize;
+            memset(&buffer[0], 0, bigSize);
+            if (bOver)
             {
-                io->sbat->set(blocks[idx], AllocTable::Avail);
-                io->sbat->markAsDirty(idx, io->bbat->blockSize);
+                // small blocks into a big block
+                uint64 first = pos / smallSize;
+                uint64 last = (pos + count + smallSize - 1) / smallSize;
+                if (last > blocks.size())
+                    last = blocks.size();
+                if (first < last)
+                    io->loadSmallBlocks(std::vector<uint64>(blocks.begin() + first, blocks.begin() + last), &buffer[0], count);
+                io->ExtendFile(&newBlocks);
+                io->saveBigBlocks(newBlocks, 0, &buffer[0], count, newBlocks.size()-1);
             }
-        }
-        else
-        {
-            for (unsigned int idx = 0; idx < blocks.size(); idx++)
+            else
             {
-                io->bbat->set(blocks[idx], AllocTable::Avail);
-                io->bbat->markAsDirty(idx, io->bbat->blockSize);
+                // a big block into small blocks
+                if (pos / bigSize < blocks.size())
+                    io->loadBigBlock(blocks[pos / bigSize], &buffer[0], count);
+                while (newBlocks.size() * smallSize < pos + count)
+                    io->ExtendSmallFile(&newBlocks);
+                io->saveSmallBlocks(newBlocks, 0, &buffer[0], count, pos / smallSize);
             }
         }
-        blocks.clear();
-        entry->start = DirTree::End;
-        // Now change the size, and write the old data back into the stream, if any
+        // Now get rid of the old blocks
+        io->freeChain(bOver ? io->sbat : io->bbat, blocks, 0);
+        chain = std::make_shared<std::vector<uint64> >(newBlocks);
+        linked = newBlocks.size();
+        entry = io->dirtree->entry(entryIdx);
+        entry->start = newBlocks.size() ? static_cast<uint32>(newBlocks[0]) : static_cast<uint32>(AllocTable::Eof);
         entry->size = newSize;
-        io->dirtree->markAsDirty(io->dirtree->indexOf(entry), io->bbat->blockSize);
-        if (len)
-        {
-            write(0, buffer, len);
-            delete [] buffer;
-        }
-        if (savePos <= entry->size)
-            seek(savePos);
+        io->dirtree->markAsDirty(entryIdx, io->bbat->blockSize);
     }
     else if (entry->size != newSize) //simple case - no threshold was crossed, so just change the size
     {
+        // blocks past the new end go back to the allocation table
+        AllocTable* table = (newSize < io->header->threshold) ? io->sbat : io->bbat;
+        uint64 needed = (newSize + table->blockSize - 1) / table->blockSize;
+        if (needed < chain->size())
+        {
+            std::vector<uint64>& blocks = ownChain();
+            io->freeChain(table, blocks, needed);
+            blocks.resize(needed);
+            if (linked > needed)
+                linked = needed;
+            if (needed == 0)
+                entry->start = static_cast<uint32>(AllocTable::Eof);
+        }
         entry->size = newSize;
-        io->dirtree->markAsDirty(io->dirtree->indexOf(entry), io->bbat->blockSize);
+        io->dirtree->markAsDirty(entryIdx, io->bbat->blockSize);
     }
 
 }
@@ -1999,20 +3929,24 @@ uint64 StreamIO::tell()
 
 int64 StreamIO::getch()
 {
-  // past end-of-file ?
-  DirEntry *entry = io->dirtree->entry(entryIdx);
-  if( m_pos >= entry->size ) return -1;
-
   // need to update cache ?
   if( !cache_size || ( m_pos < cache_pos ) ||
     ( m_pos >= cache_pos + cache_size ) )
-      updateCache();
+  {
+    // past end-of-file ?
+    if( m_pos >= size() ) return -1;
+    updateCache();
+    io->counters.add( IoCounters::CacheMisses );
+  }
+  else
+    io->counters.add( IoCounters::CacheHits );
 
   // something bad if we don't get good cache
   if( !cache_size ) return -1;
 
   int64 data = cache_data[m_pos - cache_pos];
   m_pos++;
+  io->counters.add( IoCounters::BytesDelivered );
 
   return data;
 }
@@ -2023,56 +3957,78 @@ uint64 StreamIO::read( uint64 pos, unsigned char* data, uint64 maxlen )
   if( !data ) return 0;
   if( maxlen == 0 ) return 0;
 
+  std::lock_guard<std::recursive_mutex> lock( mutex );
+
+  // whatever is still buffered has to be in the file first
+  flushWrites();
+
   uint64 totalbytes = 0;
   
-  DirEntry *entry = io->dirtree->entry(entryIdx);
-  if (pos + maxlen > entry->size)
-      maxlen = entry->size - pos;
-  if ( entry->size < io->header->threshold )
+  uint64 streamSize = size();
+  if (pos >= streamSize)
+      return 0;
+  if (pos + maxlen > streamSize)
+      maxlen = streamSize - pos;
+  const std::vector<uint64>& blocks = *chain;
+  if ( streamSize < io->header->threshold )
   {
-    // small file
+    // small file, in the mini stream shared with other streams, which only
+    // changes when the storage can be written
+    std::unique_lock<std::recursive_mutex> ioLock( io->mutex, std::defer_lock );
+    if( io->writeable )
+      ioLock.lock();
     uint64 index = pos / io->sbat->blockSize;
 
     if( index >= blocks.size() ) return 0;
 
-    unsigned char* buf = new unsigned char[ io->sbat->blockSize ];
+    // all small blocks at once, so that those sharing a big block cost one read
+    uint64 last = ( pos + maxlen - 1 ) / io->sbat->blockSize + 1;
+    if( last > blocks.size() ) last = blocks.size();
+    std::vector<unsigned char> buf( ( last - index ) * io->sbat->blockSize );
     uint64 offset = pos % io->sbat->blockSize;
-    while( totalbytes < maxlen )
+    uint64 got = io->loadSmallBlocks( std::vector<uint64>( blocks.begin() + index, blocks.begin() + last ),
+      &buf[0], buf.size() );
+    if( got > offset )
     {
-      if( index >= blocks.size() ) break;
-      io->loadSmallBlock( blocks[index], buf, io->bbat->blockSize );
-      uint64 count = io->sbat->blockSize - offset;
-      if( count > maxlen-totalbytes ) count = maxlen-totalbytes;
-      memcpy( data+totalbytes, buf + offset, count );
-      totalbytes += count;
-      offset = 0;
-      index++;
+      totalbytes = got - offset;
+      if( totalbytes > maxlen ) totalbytes = maxlen;
+      memcpy( data, &buf[offset], totalbytes );
     }
-    delete[] buf;
-
   }
   else
   {
-    // big file
+    // big file, whose blocks belong to this stream alone
     uint64 index = pos / io->bbat->blockSize;
     
     if( index >= blocks.size() ) return 0;
     
-    unsigned char* buf = new unsigned char[ io->bbat->blockSize ];
-    uint64 offset = pos % io->bbat->blockSize;
-    while( totalbytes < maxlen )
+    uint64 bs = io->bbat->blockSize;
+    uint64 offset = pos % bs;
+    std::vector<unsigned char> buf; // for a block which is only partly read
+    while( totalbytes < maxlen && index < blocks.size() )
     {
-      if( index >= blocks.size() ) break;
-      io->loadBigBlock( blocks[index], buf, io->bbat->blockSize );
-      uint64 count = io->bbat->blockSize - offset;
+      uint64 count = bs - offset;
       if( count > maxlen-totalbytes ) count = maxlen-totalbytes;
-      memcpy( data+totalbytes, buf + offset, count );
-      totalbytes += count;
-      index++;
-      offset = 0;
+      if( count < bs )
+      {
+        buf.resize( bs );
+        io->loadBigBlock( blocks[index], &buf[0], bs );
+        memcpy( data+totalbytes, &buf[offset], count );
+        totalbytes += count;
+        index++;
+        offset = 0;
+        continue;
+      }
+
+      // whole blocks go straight to data, those which follow each other in
+      // the file with one read
+      uint64 n = ( maxlen-totalbytes ) / bs;
+      if( n > blocks.size() - index ) n = blocks.size() - index;
+      io->loadBigBlocks( std::vector<uint64>( blocks.begin() + index, blocks.begin() + index + n ),
+        data+totalbytes, n * bs );
+      totalbytes += n * bs;
+      index += n;
     }
-    delete [] buf;
-
   }
 
   return totalbytes;
@@ -2082,12 +4038,16 @@ uint64 StreamIO::read( unsigned char* data, uint64 maxlen )
 {
   uint64 bytes = read( tell(), data, maxlen );
   m_pos += bytes;
+  io->counters.add( IoCounters::BytesDelivered, bytes );
   return bytes;
 }
 
 uint64 StreamIO::write( unsigned char* data, uint64 len )
 {
-  return write( tell(), data, len );
+  uint64 bytes = write( tell(), data, len );
+  m_pos += bytes;
+  if( bytes ) io->changed( bytes );
+  return bytes;
 }
 
 uint64 StreamIO::write( uint64 pos, unsigned char* data, uint64 len )
@@ -2097,74 +4057,218 @@ uint64 StreamIO::write( uint64 pos, unsigned char* data, uint64 len )
   if( len == 0 ) return 0;
   if( !io->writeable ) return 0;
 
-  DirEntry *entry = io->dirtree->entry(entryIdx);
-  if (pos + len > entry->size)
-      setSize(pos + len); //reset size, possibly changing from small to large blocks
-  uint64 totalbytes = 0;
-  if ( entry->size < io->header->threshold )
+  std::lock_guard<std::recursive_mutex> lock( mutex );
+  bool bBig;
   {
-    // small file
-    uint64 index = (pos + len - 1) / io->sbat->blockSize;
-    while (index >= blocks.size())
+    std::lock_guard<std::recursive_mutex> ioLock( io->mutex );
+    DirEntry *entry = io->dirtree->entry(entryIdx);
+    if (pos + len > entry->size)
+        setSize(pos + len); //reset size, possibly changing from small to large blocks
+    entry = io->dirtree->entry(entryIdx);
+    bBig = entry->size >= io->header->threshold;
+    if (!bBig)
     {
-        uint64 nblock = io->sbat->unused();
-        if (blocks.size() > 0)
-        {
-            io->sbat->set(blocks[blocks.size()-1], nblock);
-            io->sbat->markAsDirty(blocks[blocks.size()-1], io->bbat->blockSize);
-        }
-        io->sbat->set(nblock, AllocTable::Eof);
-        io->sbat->markAsDirty(nblock, io->bbat->blockSize);
-        blocks.resize(blocks.size()+1);
-        blocks[blocks.size()-1] = nblock;
-        uint64 bbidx = nblock / (io->bbat->blockSize / sizeof(unsigned int));
-        while (bbidx >= io->header->num_sbat)
-        {
-            std::vector<uint64> sbat_blocks = io->bbat->follow(io->header->sbat_start);
-            io->ExtendFile(&sbat_blocks);
-            io->header->num_sbat++;
-            io->header->dirty = true; //Header will have to be rewritten
-        }
-        uint64 sidx = nblock * io->sbat->blockSize / io->bbat->blockSize;
-        while (sidx >= io->sb_blocks.size()) 
-        {
-            io->ExtendFile(&io->sb_blocks);
-            io->dirtree->markAsDirty(0, io->bbat->blockSize); //make sure to rewrite first directory block
-        }
+      // allocate now, so that the chain is complete when the buffer goes out
+      uint64 index = (pos + len - 1) / io->sbat->blockSize;
+      if (index >= chain->size())
+      {
+          std::vector<uint64>& blocks = ownChain();
+          while (index >= blocks.size())
+              io->ExtendSmallFile(&blocks);
+      }
+      const std::vector<uint64>& blocks = *chain;
+      linked = blocks.size();
+      if (blocks.size() > 0 && entry->start != blocks[0])
+      {
+          entry->start = static_cast<uint32>(blocks[0]);
+          io->dirtree->markAsDirty(entryIdx, io->bbat->blockSize);
+      }
     }
-    uint64 offset = pos % io->sbat->blockSize;
-    index = pos / io->sbat->blockSize;
-    //if (index == 0)
-        totalbytes = io->saveSmallBlocks(blocks, offset, data, len, index);
   }
+  if (bBig)
+    growChain((pos + len - 1) / io->bbat->blockSize + 1);
+  cache_size = 0;
+
+  // gather writes which continue each other, anything else goes out first
+  uint64 totalbytes;
+  if (wbuf_size > 0 && (pos != wbuf_pos + wbuf_size || wbuf_size + len > WRITEBUFSIZE))
+      flushWrites();
+  if (len >= WRITEBUFSIZE)
+      totalbytes = writeBlocks(pos, data, len);
   else
   {
-    uint64 index = (pos + len - 1) / io->bbat->blockSize;
-    while (index >= blocks.size())
-        io->ExtendFile(&blocks);
-    uint64 offset = pos % io->bbat->blockSize;
-    uint64 remainder = len;
-    index = pos / io->bbat->blockSize;
-    while( remainder > 0 )
-    {
-      if( index >= blocks.size() ) break;
-      uint64 count = io->bbat->blockSize - offset;
-      if ( remainder < count )
-          count = remainder;
-      io->saveBigBlock( blocks[index], offset, data + totalbytes, count );
-      totalbytes += count;
-      remainder -= count;
-      index++;
-      offset = 0;
+      if (!wbuf_data)
+          wbuf_data = new unsigned char[WRITEBUFSIZE];
+      if (wbuf_size == 0)
+          wbuf_pos = pos;
+      memcpy(wbuf_data + wbuf_size, data, len);
+      wbuf_size += len;
+      totalbytes = len;
+  }
+  return totalbytes;
+}
+
+// forgets the buffered bytes, see StorageIO::revert
+void StreamIO::dropWrites()
+{
+  std::lock_guard<std::recursive_mutex> lock( mutex );
+  wbuf_size = 0;
+}
+
+// follows the chain again after the directory was read back from the file
+void StreamIO::reload()
+{
+  std::lock_guard<std::recursive_mutex> lock( mutex );
+  std::lock_guard<std::recursive_mutex> ioLock( io->mutex );
+  wbuf_size = 0;
+  cache_size = 0;
+  chain = std::make_shared<std::vector<uint64> >();
+  arena.clear();
+  linked = 0;
+  DirEntry* e = io->dirtree->entry( entryIdx );
+  if( !e || !e->valid || e->dir )
+  {
+    fail = true;
+    return;
+  }
+  generation = io->dirtree->generation( entryIdx );
+  if( e->size >= io->header->threshold ) 
+    *chain = io->bbat->follow( e->start );
+  else
+    *chain = io->sbat->follow( e->start );
+  linked = chain->size();
+}
+
+uint64 StreamIO::size()
+{
+  if( !io->writeable )
+    return entrySize;
+  std::lock_guard<std::recursive_mutex> ioLock( io->mutex );
+  DirEntry* e = io->dirtree->entry( entryIdx );
+  return e ? e->size : 0;
+}
+
+// makes the chain of a big stream n blocks long; the blocks come from the arena of
+// the stream, only when that runs out the storage is locked to reserve some more.
+// The arena doubles each time, up to ARENABYTES, and halves when linkBlocks() gives
+// back part of it, so that a stream flushed often does not hold much it never uses.
+void StreamIO::growChain( uint64 n )
+{
+  if( chain->size() >= n ) return;
+  std::vector<uint64>& blocks = ownChain();
+  while( blocks.size() < n )
+  {
+    if( arena.empty() )
+    {
+      std::lock_guard<std::recursive_mutex> ioLock( io->mutex );
+      uint64 want = n - blocks.size();
+      if( want < arenaSize ) want = arenaSize;
+      io->reserveBlocks( want, arena );
+      if( arenaSize * 2 * io->bbat->blockSize <= ARENABYTES ) arenaSize *= 2;
     }
+    blocks.push_back( arena.back() );
+    arena.pop_back();
   }
-  if (blocks.size() > 0 && entry->start != blocks[0])
+}
+
+// links the blocks taken from the arena into the chain of the stream and gives
+// back the rest of the arena; the caller holds both the stream's and io->mutex
+void StreamIO::linkBlocks()
+{
+  AllocTable* bbat = io->bbat;
+  if( linked < chain->size() )
   {
-      entry->start = blocks[0];
-      io->dirtree->markAsDirty(io->dirtree->indexOf(entry), io->bbat->blockSize);
+    // the blocks were added by growChain(), so the chain is not shared
+    std::vector<uint64>& blocks = *chain;
+    DirEntry* e = io->dirtree->entry( entryIdx, generation );
+    if( !e )
+    {
+      // deleted meanwhile, so the new blocks are not needed anymore
+      for( uint64 k = linked; k < blocks.size(); k++ )
+      {
+        bbat->set( blocks[k], AllocTable::Avail );
+        bbat->markAsDirty( blocks[k], bbat->blockSize );
+      }
+      blocks.resize( linked );
+    }
+    else
+    {
+      for( uint64 k = linked ? linked - 1 : 0; k + 1 < blocks.size(); k++ )
+      {
+        bbat->set( blocks[k], blocks[k+1] );
+        bbat->markAsDirty( blocks[k], bbat->blockSize );
+      }
+      if( linked == 0 )
+      {
+        e->start = static_cast<uint32>( blocks[0] );
+        io->dirtree->markAsDirty( entryIdx, bbat->blockSize );
+      }
+      linked = blocks.size();
+    }
   }
-  m_pos += len;
-  return totalbytes;
+  // the stream did not need all of it, so it gets less next time
+  if( !arena.empty() && arenaSize > ARENAMINBLOCKS )
+    arenaSize /= 2;
+  for( uint64 k = 0; k < arena.size(); k++ )
+  {
+    bbat->set( arena[k], AllocTable::Avail );
+    bbat->markAsDirty( arena[k], bbat->blockSize );
+  }
+  arena.clear();
+}
+
+// writes the buffered bytes and links new blocks, see StorageIO::flush
+void StreamIO::mergeWrites()
+{
+  std::lock_guard<std::recursive_mutex> lock( mutex );
+  flushWrites();
+  std::lock_guard<std::recursive_mutex> ioLock( io->mutex );
+  linkBlocks();
+}
+
+// writes the buffered bytes to the file
+void StreamIO::flushWrites()
+{
+  std::lock_guard<std::recursive_mutex> lock( mutex );
+  if (wbuf_size == 0) return;
+  uint64 len = wbuf_size;
+  wbuf_size = 0;
+  writeBlocks(wbuf_pos, wbuf_data, len);
+}
+
+uint64 StreamIO::writeBlocks( uint64 pos, unsigned char* data, uint64 len )
+{
+  uint64 offset = pos % io->bbat->blockSize;
+  uint64 index = pos / io->bbat->blockSize;
+  std::unique_lock<std::recursive_mutex> ioLock( io->mutex );
+  DirEntry *entry = io->dirtree->entry(entryIdx);
+  if ( entry->size < io->header->threshold )
+  {
+    // small file
+    offset = pos % io->sbat->blockSize;
+    index = pos / io->sbat->blockSize;
+    return io->saveSmallBlocks(*chain, offset, data, len, index);
+  }
+  if (io->transacted)
+  {
+    // sectors of the last commit get replaced, copying what is not overwritten
+    uint64 bs = io->bbat->blockSize;
+    for (uint64 k = index; k <= (pos + len - 1) / bs && k < chain->size(); k++)
+    {
+      if (!io->bbat->isFrozen((*chain)[k]))
+        continue;
+      bool bCovered = (k * bs >= pos) && ((k + 1) * bs <= pos + len || pos + len >= entry->size);
+      io->copyOnWrite(&ownChain(), k, !bCovered);
+      if (k == 0)
+      {
+        entry->start = static_cast<uint32>((*chain)[0]);
+        io->dirtree->markAsDirty(entryIdx, bs);
+      }
+    }
+  }
+  // the blocks belong to this stream alone
+  ioLock.unlock();
+  return io->saveBigBlocks(*chain, offset, data, len, index);
 }
 
 void StreamIO::flush()
@@ -2174,13 +4278,13 @@ void StreamIO::flush()
 
 void StreamIO::updateCache()
 {
-  // sanity check
-  if( !cache_data ) return;
+  if( !cache_data )
+    cache_data = new unsigned char[CACHEBUFSIZE];
 
-  DirEntry *entry = io->dirtree->entry(entryIdx);
+  uint64 streamSize = size();
   cache_pos = m_pos - (m_pos % CACHEBUFSIZE);
   uint64 bytes = CACHEBUFSIZE;
-  if( cache_pos + bytes > entry->size ) bytes = entry->size - cache_pos;
+  if( cache_pos + bytes > streamSize ) bytes = streamSize - cache_pos;
   cache_size = read( cache_pos, cache_data, bytes );
 }
 
@@ -2202,9 +4306,26 @@ int Storage::result()
   return (int) io->result;
 }
 
-bool Storage::open(bool bWriteAccess, bool bCreate)
+std::future<bool> Storage::openAsync(bool bWriteAccess, bool bCreate, int flags, uint64 expectedSize)
 {
-  return io->open(bWriteAccess, bCreate);
+  StorageIO* sio = io;
+  return runAsync<bool>( [=]() { return sio->open( bWriteAccess, bCreate, flags, expectedSize ); } );
+}
+
+Storage* Storage::snapshot()
+{
+  Storage* view = new Storage( io->filename.c_str() );
+  if( !io->snapshot( view->io ) )
+  {
+    delete view;
+    return 0;
+  }
+  return view;
+}
+
+bool Storage::open(bool bWriteAccess, bool bCreate, int flags, uint64 expectedSize)
+{
+  return io->open(bWriteAccess, bCreate, flags, expectedSize);
 }
 
 void Storage::close()
@@ -2212,9 +4333,27 @@ void Storage::close()
   io->close();
 }
 
+void Storage::setFlushPolicy( int policy, uint64 amount )
+{
+  std::lock_guard<std::recursive_mutex> lock( io->mutex );
+  io->flushPolicy = policy;
+  io->flushAmount = amount;
+}
+
+bool Storage::commit()
+{
+  return io->commit();
+}
+
+void Storage::revert()
+{
+  io->revert();
+}
+
 std::list<std::string> Storage::entries( const std::string& path )
 {
   std::list<std::string> localResult;
+  std::lock_guard<std::recursive_mutex> lock( io->mutex );
   DirTree* dt = io->dirtree;
   DirEntry* e = dt->entry( path, false );
   if( e  && e->dir )
@@ -2222,7 +4361,7 @@ std::list<std::string> Storage::entries( const std::string& path )
     uint64 parent = dt->indexOf( e );
     std::vector<uint64> children = dt->children( parent );
     for( uint64 i = 0; i < children.size(); i++ )
-      localResult.push_back( dt->entry( children[i] )->name );
+      localResult.push_back( dt->name( dt->entry( children[i] ) ) );
   }
   
   return localResult;
@@ -2230,12 +4369,14 @@ std::list<std::string> Storage::entries( const std::string& path )
 
 bool Storage::isDirectory( const std::string& name )
 {
+  std::lock_guard<std::recursive_mutex> lock( io->mutex );
   DirEntry* e = io->dirtree->entry( name, false );
   return e ? e->dir : false;
 }
 
 bool Storage::exists( const std::string& name )
 {
+    std::lock_guard<std::recursive_mutex> lock( io->mutex );
     DirEntry* e = io->dirtree->entry( name, false );
     return (e != 0);
 }
@@ -2250,10 +4391,93 @@ bool Storage::deleteByName( const std::string& name )
   return io->deleteByName(name);
 }
 
+EntryHandle Storage::handle( const std::string& path )
+{
+  EntryHandle h;
+  std::lock_guard<std::recursive_mutex> lock( io->mutex );
+  DirEntry* e = io->dirtree->entry( path, false );
+  if( e && e->valid )
+  {
+    h.index = static_cast<uint32>( io->dirtree->indexOf( e ) );
+    h.generation = io->dirtree->generation( h.index );
+  }
+  return h;
+}
+
+std::vector<EntryHandle> Storage::children( const EntryHandle& dir )
+{
+  std::vector<EntryHandle> result;
+  std::lock_guard<std::recursive_mutex> lock( io->mutex );
+  DirTree* dt = io->dirtree;
+  DirEntry* e = dt->entry( dir.index, dir.generation );
+  if( e && e->dir )
+  {
+    std::vector<uint64> chi = dt->children( dir.index );
+    result.resize( chi.size() );
+    for( uint64 i = 0; i < chi.size(); i++ )
+    {
+      result[i].index = static_cast<uint32>( chi[i] );
+      result[i].generation = dt->generation( chi[i] );
+    }
+  }
+  return result;
+}
+
+bool Storage::stat( const EntryHandle& h, EntryInfo& info )
+{
+  std::lock_guard<std::recursive_mutex> lock( io->mutex );
+  DirEntry* e = io->dirtree->entry( h.index, h.generation );
+  if( !e ) return false;
+  info.name = h.index ? io->dirtree->name( e ) : std::string( "/" );
+  info.isDirectory = e->dir;
+  info.size = e->dir ? 0 : e->size;
+  info.offset = 0;
+  if( !e->dir && e->size > 0 && e->start < AllocTable::MetaBat )
+  {
+    uint64 bigSize = io->bbat->blockSize;
+    if( e->size >= io->header->threshold )
+      info.offset = ( e->start + 1 ) * bigSize;
+    else
+    {
+      // small blocks lie within the big blocks of the mini stream
+      uint64 pos = e->start * io->sbat->blockSize;
+      if( pos / bigSize < io->sb_blocks.size() )
+        info.offset = ( io->sb_blocks[pos / bigSize] + 1 ) * bigSize + pos % bigSize;
+    }
+  }
+  return true;
+}
+
+bool Storage::deleteByHandle( const EntryHandle& h )
+{
+  bool ok;
+  {
+    std::lock_guard<std::recursive_mutex> lock( io->mutex );
+    DirEntry* e = io->dirtree->entry( h.index, h.generation );
+    if( !e ) return false;
+    int64 parentIdx = io->dirtree->parent( h.index );
+    if( parentIdx < 0 ) return false;
+    ok = io->deleteEntry( e, parentIdx );
+  }
+  if( ok ) io->changed( 0 );
+  return ok;
+}
+
+bool Storage::createStreams( const std::vector<std::string>& names, const std::vector<uint64>& sizes )
+{
+  return io->createEntries( names, sizes );
+}
+
+bool Storage::importTree( const std::string& hostPath, const std::string& path )
+{
+  return io->importTree( hostPath, path );
+}
+
 void Storage::GetStats(uint64 *pEntries, uint64 *pUnusedEntries,
       uint64 *pBigBlocks, uint64 *pUnusedBigBlocks,
       uint64 *pSmallBlocks, uint64 *pUnusedSmallBlocks)
 {
+    std::lock_guard<std::recursive_mutex> lock( io->mutex );
     *pEntries = io->dirtree->entryCount();
     *pUnusedEntries = io->dirtree->unusedEntryCount();
     *pBigBlocks = io->bbat->count();
@@ -2262,6 +4486,37 @@ void Storage::GetStats(uint64 *pEntries, uint64 *pUnusedEntries,
     *pUnusedSmallBlocks = io->sbat->unusedCount();
 }
 
+IoStats Storage::ioStats()
+{
+  IoCounters& c = io->counters;
+  IoStats stats;
+  stats.reads = c.get( IoCounters::Reads );
+  stats.writes = c.get( IoCounters::Writes );
+  stats.bytesRead = c.get( IoCounters::BytesRead );
+  stats.bytesWritten = c.get( IoCounters::BytesWritten );
+  stats.seeks = c.get( IoCounters::Seeks );
+  stats.sectorsRead = c.get( IoCounters::SectorsRead );
+  stats.sectorsWritten = c.get( IoCounters::SectorsWritten );
+  stats.miniSectorsRead = c.get( IoCounters::MiniSectorsRead );
+  stats.cacheHits = c.get( IoCounters::CacheHits );
+  stats.cacheMisses = c.get( IoCounters::CacheMisses );
+  stats.chainFollows = c.get( IoCounters::ChainFollows );
+  stats.chainLinks = c.get( IoCounters::ChainLinks );
+  stats.flushes = c.get( IoCounters::Flushes );
+  stats.bytesDelivered = c.get( IoCounters::BytesDelivered );
+  return stats;
+}
+
+void Storage::resetIoStats()
+{
+  io->counters.reset();
+}
+
+double IoStats::readAmplification() const
+{
+  return bytesDelivered ? (double) bytesRead / bytesDelivered : 0;
+}
+
 // recursively collect stream names
 void CollectStreams( std::list<std::string>& result, DirTree* tree, DirEntry* parent, const std::string& path )
 {
@@ -2272,9 +4527,9 @@ void CollectStreams( std::list<std::string>& result, DirTree* tree, DirEntry* pa
     DirEntry* e = queue.front();
     queue.pop();
     if ( e->dir )
-      CollectStreams( result, tree, e, path + e->name + "/" );
+      CollectStreams( result, tree, e, path + tree->name( e ) + "/" );
     else
-      result.push_back( path + e->name );
+      result.push_back( path + tree->name( e ) );
     DirEntry* p = tree->entry( e->prev );
     if ( p ) queue.push( p );
     DirEntry* n = tree->entry( e->next );
@@ -2287,11 +4542,157 @@ void CollectStreams( std::list<std::string>& result, DirTree* tree, DirEntry* pa
 std::list<std::string> Storage::GetAllStreams( const std::string& storageName )
 {
   std::list<std::string> vresult;
+  std::lock_guard<std::recursive_mutex> lock( io->mutex );
   DirEntry* e = io->dirtree->entry( storageName, false );
   if ( e && e->dir ) CollectStreams( vresult, io->dirtree, e, storageName );
   return vresult;
 }
 
+// Each thread lists the directories it finds itself, depth first, and puts the
+// streams in them in batches next to the subdirectories. It takes its own tasks
+// from the back, so it goes on with the last directory it found; a thread without
+// tasks left steals from the front of another, the least recently made one, so
+// threads rarely meet, and even the streams of a single directory are spread over
+// all threads. Threads without anything to do sleep until there is again.
+uint64 Storage::forEachStream( const StreamVisitor& visit, const std::string& path, unsigned nthreads )
+{
+  std::vector<WalkDeque> deques( nthreads ? nthreads : std::max( std::thread::hardware_concurrency(), 1u ) );
+  {
+    std::lock_guard<std::recursive_mutex> lock( io->mutex );
+    DirEntry* e = io->dirtree->entry( path, false );
+    if( !e || !e->dir ) return 0;
+    WalkTask task;
+    task.dir = true;
+    task.index = io->dirtree->indexOf( e );
+    task.path = path;
+    if( task.path.empty() || task.path[task.path.size()-1] != '/' )
+      task.path += '/';
+    deques[0].tasks.push_back( task );
+  }
+  std::atomic<uint64> pending( 1 );   // tasks made and not done yet
+  std::atomic<uint64> queued( 1 );    // of them, those no thread has taken yet
+  std::atomic<uint64> visited( 0 );
+  std::mutex idleMutex;
+  std::condition_variable idle;        // signalled when tasks are queued or all are done
+
+  std::function<void( unsigned )> work = [&]( unsigned self )
+  {
+    uint64 count = 0;
+    for( ;; )
+    {
+      WalkTask task;
+      bool found = false;
+      {
+        std::lock_guard<std::mutex> lock( deques[self].mutex );
+        if( !deques[self].tasks.empty() )
+        {
+          std::swap( task, deques[self].tasks.back() );
+          deques[self].tasks.pop_back();
+          found = true;
+        }
+      }
+      for( unsigned k = 1; !found && k < deques.size(); k++ )
+      {
+        WalkDeque& victim = deques[( self + k ) % deques.size()];
+        std::lock_guard<std::mutex> lock( victim.mutex );
+        if( !victim.tasks.empty() )
+        {
+          std::swap( task, victim.tasks.front() );
+          victim.tasks.pop_front();
+          found = true;
+        }
+      }
+      if( !found )
+      {
+        std::unique_lock<std::mutex> lock( idleMutex );
+        idle.wait( lock, [&]() { return pending == 0 || queued > 0; } );
+        if( pending == 0 ) break;
+        continue;
+      }
+      queued--;
+
+      if( !task.dir )
+      {
+        for( uint64 i = 0; i < task.handles.size(); i++ )
+          visit( task.handles[i], task.names[i], task.sizes[i] );
+        count += task.handles.size();
+      }
+      else
+      {
+        // the entries of the directory, all at once; the batches of streams go
+        // before the subdirectories, so that these are listed first
+        std::vector<WalkTask> tasks, dirs;
+        {
+          std::lock_guard<std::recursive_mutex> lock( io->mutex );
+          std::vector<uint64> chi = io->dirtree->children( task.index );
+          WalkTask streams;
+          streams.dir = false;
+          for( uint64 i = 0; i < chi.size(); i++ )
+          {
+            DirEntry* c = io->dirtree->entry( chi[i] );
+            if( c->dir )
+            {
+              WalkTask sub;
+              sub.dir = true;
+              sub.index = chi[i];
+              sub.path = task.path + io->dirtree->name( c ) + "/";
+              dirs.push_back( sub );
+              continue;
+            }
+            EntryHandle h;
+            h.index = static_cast<uint32>( chi[i] );
+            h.generation = io->dirtree->generation( chi[i] );
+            streams.handles.push_back( h );
+            streams.names.push_back( task.path + io->dirtree->name( c ) );
+            streams.sizes.push_back( c->size );
+            if( streams.handles.size() == WALKBATCH )
+            {
+              tasks.push_back( WalkTask() );
+              std::swap( tasks.back(), streams );
+              streams.dir = false;
+            }
+          }
+          if( !streams.handles.empty() )
+          {
+            tasks.push_back( WalkTask() );
+            std::swap( tasks.back(), streams );
+          }
+        }
+        tasks.insert( tasks.end(), dirs.begin(), dirs.end() );
+        if( !tasks.empty() )
+        {
+          pending += tasks.size();
+          queued += tasks.size();
+          {
+            std::lock_guard<std::mutex> lock( deques[self].mutex );
+            for( uint64 i = 0; i < tasks.size(); i++ )
+            {
+              deques[self].tasks.push_back( WalkTask() );
+              std::swap( deques[self].tasks.back(), tasks[i] );
+            }
+          }
+          std::lock_guard<std::mutex> lock( idleMutex );
+          idle.notify_all();
+        }
+      }
+      if( --pending == 0 )
+      {
+        std::lock_guard<std::mutex> lock( idleMutex );
+        idle.notify_all();
+      }
+    }
+    visited += count;
+  };
+
+  std::vector<std::thread> threads;
+  for( unsigned t = 1; t < deques.size(); t++ )
+    threads.push_back( std::thread( work, t ) );
+  work( 0 );
+  for( unsigned t = 0; t < threads.size(); t++ )
+    threads[t].join();
+  return visited;
+}
+
 // =========== Stream ==========
 
 Stream::Stream( Storage* storage, const std::string& name, bool bCreate, int64 streamSize )
@@ -2299,6 +4700,35 @@ Stream::Stream( Storage* storage, const std::string& name, bool bCreate, int64 s
 {
 }
 
+Stream::Stream( Storage* storage, const EntryHandle& handle )
+:   io(0)
+{
+  bool bValid;
+  {
+    std::lock_guard<std::recursive_mutex> lock( storage->io->mutex );
+    bValid = storage->io->dirtree->entry( handle.index, handle.generation ) != 0;
+  }
+  if( bValid )
+    io = storage->io->streamIO( handle.index );
+}
+
+Stream::Stream( StreamIO* streamIO )
+:   io(streamIO)
+{
+}
+
+// false once the stream or its storage is closed
+static bool attached( StreamIO* io )
+{
+  return io && io->io;
+}
+
+Stream* Stream::clone()
+{
+  if( !attached( io ) ) return 0;
+  return new Stream( new StreamIO( io ) );
+}
+
 // FIXME tell parent we're gone
 Stream::~Stream()
 {
@@ -2307,66 +4737,94 @@ Stream::~Stream()
 
 std::string Stream::fullName()
 {
-  return io ? io->fullName : std::string();
+  if( !attached( io ) ) return std::string();
+  if( io->fullName.empty() )
+  {
+    std::lock_guard<std::recursive_mutex> lock( io->io->mutex );
+    io->fullName = io->io->dirtree->fullName( io->entryIdx );
+  }
+  return io->fullName;
 }
 
 uint64 Stream::tell()
 {
-  return io ? io->tell() : 0;
+  return attached( io ) ? io->tell() : 0;
 }
 
 void Stream::seek( uint64 newpos )
 {
-  if( io )
+  if( attached( io ) )
       io->seek(newpos);
 }
 
 uint64 Stream::size()
 {
-    if (!io)
+    if (!attached( io ))
         return 0;
-    DirEntry *entry = io->io->dirtree->entry(io->entryIdx);
-    return entry->size;
+    return io->size();
 }
 
 void Stream::setSize(int64 newSize)
 {
-    if (!io)
+    if (!attached( io ))
         return;
     if (newSize < 0)
         return;
     if (newSize > std::numeric_limits<int64>::max())
         return;
     io->setSize(newSize);
+    io->io->changed(0);
 }
 
 int64 Stream::getch()
 {
-  return io ? io->getch() : 0;
+  return attached( io ) ? io->getch() : 0;
 }
 
 uint64 Stream::read( unsigned char* data, uint64 maxlen )
 {
-  return io ? io->read( data, maxlen ) : 0;
+  return attached( io ) ? io->read( data, maxlen ) : 0;
 }
 
 uint64 Stream::write( unsigned char* data, uint64 len )
 {
-    return io ? io->write( data, len ) : 0;
+    return attached( io ) ? io->write( data, len ) : 0;
+}
+
+std::future<uint64> Stream::readAsync( uint64 pos, unsigned char* data, uint64 maxlen )
+{
+  StreamIO* sio = io;
+  return runAsync<uint64>( [=]() -> uint64 {
+    if( !attached( sio ) ) return 0;
+    uint64 bytes = sio->read( pos, data, maxlen );
+    sio->io->counters.add( IoCounters::BytesDelivered, bytes );
+    return bytes;
+  } );
+}
+
+std::future<uint64> Stream::writeAsync( uint64 pos, unsigned char* data, uint64 len )
+{
+  StreamIO* sio = io;
+  return runAsync<uint64>( [=]() -> uint64 {
+    if( !attached( sio ) ) return 0;
+    uint64 bytes = sio->write( pos, data, len );
+    if( bytes ) sio->io->changed( bytes );
+    return bytes;
+  } );
 }
 
 void Stream::flush()
 {
-    if (io)
+    if (attached( io ))
         io->flush();
 }
 
 bool Stream::eof()
 {
-  return io ? io->eof : false;
+  return attached( io ) ? io->eof : false;
 }
 
 bool Stream::fail()
 {
-  return io ? io->fail : true;
+  return attached( io ) ? io->fail : true;
 }
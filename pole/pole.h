@@ -53,6 +53,36 @@ This is a default behavior for windows and is defined by the macro POLE_USE_UTF1
 Using a provided function and a modern c++ compiler it's easy to encode a 
 wide string into utf8 char*:
     std::string POLE::UTF16toUTF8(const std::wstring &utf16);
+
+Names of streams and storages are UTF-8 as well. They are kept as UTF-16
+internally and written back unchanged, including a leading control character
+such as in "\005SummaryInformation". As in Microsoft's implementation, names
+are compared without regard to case, so "/WORKBOOK" finds "/Workbook". A name
+with a leading control character is also found without it, so that
+"/SummaryInformation" still finds "\005SummaryInformation"; entries() and the
+like return it with the character.
+*/
+
+/*
+Thread notes:
+
+Different streams of one storage may be written by different threads at the
+same time, as long as each Stream object is used by one thread only; its pending
+asynchronous operations count as that thread, see Stream::readAsync(). The data
+of big streams goes to sectors reserved for each stream and is written without
+locking the storage; these sectors are entered in the allocation table when the
+stream is flushed or destroyed. Apart from open() and close(), the functions of
+Storage may be called from any thread meanwhile.
+
+Likewise, any number of threads may read streams of one storage at the same
+time, each through Stream objects of its own; several of them may refer to the
+same stream. A Stream keeps its position and read cache to itself, and the file
+is read at given positions, never through a shared file position. When the
+storage is opened read-only, its header, allocation tables and directory do not
+change after open(), so reading a stream takes no lock shared with other streams;
+only opening a stream and the functions of Storage look at the directory under a
+lock. Reading while streams are written is safe as well, but then a stream which
+is written at the same time may be read partly before and partly after the write.
 */
 
 #ifndef POLE_H
@@ -61,6 +91,9 @@ wide string into utf8 char*:
 #include <cstdio>
 #include <string>
 #include <list>
+#include <vector>
+#include <functional>
+#include <future>
 
 namespace POLE
 {
@@ -70,11 +103,13 @@ namespace POLE
 #define POLE_WIN
 typedef __int32 int32;
 typedef __int64 int64;
+typedef unsigned __int16 uint16;
 typedef unsigned __int32 uint32;
 typedef unsigned __int64 uint64;
 #else
 typedef int int32;
 typedef long long int64;
+typedef unsigned short uint16;
 typedef unsigned int uint32;
 typedef unsigned long long uint64;
 #endif
@@ -90,6 +125,72 @@ class StorageIO;
 class Stream;
 class StreamIO;
 
+/**
+ * Refers to an entry (stream or directory) of an open storage by its position in
+ * the directory, so it can be used again without resolving its path. A handle no
+ * longer refers to anything once its entry is deleted, even if the position is
+ * reused for a new entry.
+ **/
+class EntryHandle
+{
+  friend class Storage;
+  friend class Stream;
+
+public:
+  EntryHandle(): index( 0xffffffff ), generation( 0 ) {}
+
+  /**
+   * Returns true if the handle was never set, e.g. because the path was not found.
+   **/
+  bool isNull() const { return index == 0xffffffff; }
+
+  bool operator==( const EntryHandle& h ) const { return index == h.index && generation == h.generation; }
+  bool operator!=( const EntryHandle& h ) const { return !( *this == h ); }
+
+private:
+  uint32 index;        // position in the directory
+  uint32 generation;   // deletions of that position so far
+};
+
+/**
+ * Information about an entry, see Storage::stat().
+ **/
+struct EntryInfo
+{
+  std::string name;    // name of the entry, without its path
+  bool isDirectory;
+  uint64 size;         // size of a stream, 0 for directories
+  uint64 offset;       // where the data of a stream starts in the file, 0 if it has none;
+                       // reading streams in this order keeps seeking down
+};
+
+/**
+ * What a storage did at the file level, see Storage::ioStats(). Sectors are the big
+ * ones, including those of the allocation tables and the directory.
+ **/
+struct IoStats
+{
+  uint64 reads;            // read calls to the file
+  uint64 writes;           // write calls to the file
+  uint64 bytesRead;        // bytes read from the file
+  uint64 bytesWritten;     // bytes written to the file
+  uint64 seeks;            // reads and writes not starting where the previous one ended
+  uint64 sectorsRead;
+  uint64 sectorsWritten;
+  uint64 miniSectorsRead;  // small sectors read from the mini stream
+  uint64 cacheHits;        // getch() calls served by the read cache of the stream
+  uint64 cacheMisses;      // getch() calls which filled it
+  uint64 chainFollows;     // chains followed through an allocation table
+  uint64 chainLinks;       // sectors found on them
+  uint64 flushes;          // flushes, including those of commits and the flush policy
+  uint64 bytesDelivered;   // bytes given to callers by Stream::read(), getch() and readAsync()
+
+  /**
+   * Returns the bytes read from the file per byte delivered, or 0 if nothing was delivered.
+   **/
+  double readAmplification() const;
+};
+
 class Storage
 {
   friend class Stream;
@@ -99,6 +200,17 @@ public:
 
   // for Storage::result()
   enum { Ok, OpenFailed, NotOLE, BadOLE, UnknownError };
+
+  // for Storage::setFlushPolicy()
+  enum { FlushManual, FlushOnClose, FlushEveryOps, FlushEveryBytes, FlushEverySeconds };
+
+  // flags for Storage::open()
+  enum {
+    LazyDirectory = 1,  // read directory sectors only when an entry in them is needed
+    Transacted = 2,     // changes reach the file only on commit(), see there
+    LargeSectors = 4,   // when creating: version 4 file with 4096-byte sectors
+    ParallelLoad = 8    // read allocation tables and directory on several threads
+  };
   
   /**
    * Constructs a storage with name filename.
@@ -112,13 +224,68 @@ public:
   
   /**
    * Opens the storage. Returns true if no error occurs.
+   * flags is a combination of the open flags above; with LazyDirectory, directory
+   * sectors are read and decoded only when an entry in them is needed. Opening then
+   * still follows the directory chain and makes room for all its entries, so it
+   * grows with the directory, only much more slowly. New files have
+   * 512-byte sectors unless LargeSectors is given; 4096-byte sectors mean fewer
+   * allocation table entries and shorter chains for large streams. ParallelLoad
+   * makes opening a large file faster where the disk serves several reads at once.
+   * When creating, expectedSize is the size the file is expected to reach, for
+   * which disk space is reserved right away. Either way, space is reserved in
+   * ever larger pieces as the file grows; the file size itself always covers
+   * the sectors in use only, once flushed or closed.
    **/
-  bool open(bool bWriteAccess = false, bool bCreate = false);
+  bool open(bool bWriteAccess = false, bool bCreate = false, int flags = 0, uint64 expectedSize = 0);
 
   /**
-   * Closes the storage.
+   * Opens the storage as open() does, but on one of the threads which run asynchronous
+   * operations; the future tells whether it worked. Nothing else may be done with the
+   * storage meanwhile.
+   **/
+  std::future<bool> openAsync(bool bWriteAccess = false, bool bCreate = false, int flags = 0, uint64 expectedSize = 0);
+
+  /**
+   * Closes the storage, flushing it unless the flush policy is FlushManual. In
+   * transacted mode, changes which were not committed are lost. Streams
+   * still open on it fail from then on: reads and writes return 0.
    **/
   void close();
+
+  /**
+   * Chooses when changes are written to the file without being asked to by
+   * Stream::flush() or commit(): never (FlushManual), when the storage is closed
+   * (FlushOnClose, the default), or in addition after every amount operations,
+   * written bytes or seconds. Operations are writes, size changes, creations and
+   * deletions; the time is checked whenever one of them is done. In transacted
+   * mode this applies to stream data only, see commit().
+   **/
+  void setFlushPolicy( int policy, uint64 amount = 0 );
+
+  /**
+   * Writes all changes to the file. With Transacted, changes are written to unused
+   * sectors only and the header is switched over to them last, so a crash leaves
+   * the file as of the previous commit. Without, this is the same as Stream::flush().
+   * Returns true if no error occurs.
+   **/
+  bool commit();
+
+  /**
+   * Throws away all changes since the last commit (transacted mode only). Open
+   * streams which do not exist anymore fail from then on. Handles taken before
+   * do not refer to anything anymore, see handle().
+   **/
+  void revert();
+
+  /**
+   * Returns a new read-only storage of the file as of the last commit, or 0 if there
+   * is none yet or this storage is writeable but not transacted. While it exists, it
+   * goes on showing that version, however this storage changes and commits: the sectors
+   * it reads are not reused meanwhile. Its streams are read without locks shared with
+   * this storage, from any threads. Delete it when done; it may outlive close(), but
+   * not the file being opened for writing again.
+   **/
+  Storage* snapshot();
   
   /**
    * Returns the error code of last operation.
@@ -148,10 +315,31 @@ public:
   /**
    * Deletes a specified stream or directory. If directory, it will
    * recursively delete everything underneath said directory.
+   * The file is updated as the flush policy says.
    * returns true for success
    */
   bool deleteByName( const std::string& name );
 
+  /**
+   * Creates many streams at once, along with their parent directories; this is much
+   * faster than creating them one by one. Existing entries are left alone. If given,
+   * sizes[i] is the size of stream names[i], whose sectors are then reserved right away.
+   * A name ending with a slash creates a directory instead. Returns true for success.
+   */
+  bool createStreams( const std::vector<std::string>& names,
+      const std::vector<uint64>& sizes = std::vector<uint64>() );
+
+  /**
+   * Copies the host directory hostPath with everything below it into the directory
+   * path of the storage, which is created if needed. All streams are created and
+   * sized up front, files are read in large pieces on a second thread while earlier
+   * ones are written, and the file is updated once at the end unless the flush policy
+   * is FlushManual. Returns true if everything was copied; files which could not be
+   * read, or whose names clash in the storage (names are compared without regard to
+   * case and cut to 31 characters), are cut short or left out.
+   */
+  bool importTree( const std::string& hostPath, const std::string& path = "/" );
+
   /**
    * Returns an accumulation of information, hopefully useful for determining if the storage
    * should be defragmented.
@@ -163,6 +351,54 @@ public:
 
   std::list<std::string> GetAllStreams( const std::string& storageName );
 
+  /**
+   * Returns the counters of what the storage did at the file level since it was
+   * constructed or resetIoStats() was called. All threads update them without locks,
+   * so the counters of one call may be a few operations apart from each other. A
+   * snapshot() counts on its own.
+   **/
+  IoStats ioStats();
+
+  /**
+   * Sets all counters of ioStats() back to zero.
+   **/
+  void resetIoStats();
+
+  // for Storage::forEachStream(): called with the handle, full name and size of a stream
+  typedef std::function<void( const EntryHandle& h, const std::string& path, uint64 size )> StreamVisitor;
+
+  /**
+   * Calls visit for every stream below the directory path, on nthreads threads
+   * (by default one per processor) including the calling one, which returns when
+   * all are done. Subdirectories, and the streams of each directory in small
+   * batches, are spread over the threads as they are found, so visit should do
+   * the work per stream, such as reading it through
+   * Stream( this, h ); it is called from several threads at the same time, in
+   * no particular order. Returns the number of streams visited.
+   **/
+  uint64 forEachStream( const StreamVisitor& visit, const std::string& path = "/", unsigned nthreads = 0 );
+
+  /**
+   * Returns a handle for the entry at path (e.g. "/" for the root), which is null
+   * if there is no such entry.
+   **/
+  EntryHandle handle( const std::string& path );
+
+  /**
+   * Returns handles for the entries of directory dir.
+   **/
+  std::vector<EntryHandle> children( const EntryHandle& dir );
+
+  /**
+   * Fills info for the entry h. Returns false if h does not refer to an entry anymore.
+   **/
+  bool stat( const EntryHandle& h, EntryInfo& info );
+
+  /**
+   * Deletes the entry h, as deleteByName() does. Returns true for success.
+   **/
+  bool deleteByHandle( const EntryHandle& h );
+
 private:
   StorageIO* io;
   
@@ -185,6 +421,21 @@ public:
   // name must be absolute, e.g "/Workbook"
   Stream( Storage* storage, const std::string& name, bool bCreate = false, int64 streamSize = 0);
 
+  /**
+   * Opens the existing stream h; fail() is true if h is not a stream anymore.
+   */
+  Stream( Storage* storage, const EntryHandle& h );
+
+  /**
+   * Returns a new stream on the same data, with a read/write position of its own
+   * which starts where this one is, or 0 if the storage is closed. Nothing is looked
+   * up again: the clone shares the sector chain of this stream, so it costs little
+   * even for a huge stream. If the storage can be written, the two are like streams
+   * opened twice on the same path: neither is meant to read what the other writes.
+   * Delete it when done.
+   **/
+  Stream* clone();
+
   /**
    * Destroys the stream.
    */
@@ -232,8 +483,24 @@ public:
    **/
   uint64 write( unsigned char* data, uint64 len );
 
+  /**
+   * Reads up to maxlen bytes from position pos on one of the threads which run
+   * asynchronous operations; the future gets the number of bytes read. The read/write
+   * position stays as it is. Any number of readAsync() and writeAsync() may be pending
+   * at once, also on one stream, but the stream and data must stay until they are done,
+   * and the other functions of the same Stream object must not be called meanwhile.
+   **/
+  std::future<uint64> readAsync( uint64 pos, unsigned char* data, uint64 maxlen );
+
+  /**
+   * Writes len bytes at position pos, as readAsync() reads them; the future gets the
+   * number of bytes written. Writes pending at the same time may be done in any order.
+   **/
+  std::future<uint64> writeAsync( uint64 pos, unsigned char* data, uint64 len );
+
   /**
    * Makes sure that any changes for the stream (and the structured storage) have been written to disk.
+   * In transacted mode, the changes only become part of the storage with Storage::commit().
    **/
   void flush();
   
@@ -250,6 +517,8 @@ public:
 private:
   StreamIO* io;
 
+  Stream( StreamIO* io );
+
   // no copy or assign
   Stream( const Stream& );
   Stream& operator=( const Stream& );    
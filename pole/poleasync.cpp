@@ -0,0 +1,143 @@
+/* POLE - Portable library to access OLE Storage 
+
+   Redistribution and use in source and binary forms, with or without 
+   modification, are permitted provided that the following conditions 
+   are met:
+   * Redistributions of source code must retain the above copyright notice, 
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice, 
+     this list of conditions and the following disclaimer in the documentation 
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be 
+     used to endorse or promote products derived from this software without 
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" 
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE 
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE 
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE 
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR 
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF 
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS 
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN 
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF 
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Example of the asynchronous API: all streams of a storage are read at once,
+// each read running on the I/O threads of the library while this thread only
+// starts them and collects the results.
+
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <list>
+#include <string>
+#include <vector>
+#include <future>
+#include <chrono>
+
+#include "pole.h"
+
+// creates count streams of different sizes, written asynchronously as well
+bool create( const char* filename, unsigned count )
+{
+  POLE::Storage storage( filename );
+  if( !storage.openAsync( true, true ).get() )
+    return false;
+
+  std::vector<POLE::Stream*> streams( count );
+  std::vector<std::vector<unsigned char> > data( count );
+  std::vector<std::future<POLE::uint64> > pending( count );
+  for( unsigned i = 0; i < count; i++ )
+  {
+    char name[64];
+    sprintf( name, "/dir%u/stream%u", i % 10, i );
+    streams[i] = new POLE::Stream( &storage, name, true );
+    data[i].resize( ( i % 4 ) ? ( i * 37 ) % 4000 : 4096 + ( i * 7919 ) % 100000 );
+    for( unsigned j = 0; j < data[i].size(); j++ )
+      data[i][j] = (unsigned char)( i + j );
+    pending[i] = streams[i]->writeAsync( 0, data[i].empty() ? 0 : &data[i][0], data[i].size() );
+  }
+
+  bool ok = true;
+  for( unsigned i = 0; i < count; i++ )
+  {
+    if( pending[i].get() != data[i].size() )
+      ok = false;
+    delete streams[i];
+  }
+  storage.close();
+  return ok;
+}
+
+// reads every stream of the storage, all of them at the same time
+int readAll( const char* filename )
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  POLE::Storage storage( filename );
+  std::future<bool> opened = storage.openAsync();
+  // ... other work could be done here ...
+  if( !opened.get() )
+  {
+    std::cout << "Error on file " << filename << std::endl;
+    return 1;
+  }
+
+  std::list<std::string> names = storage.GetAllStreams( "/" );
+  std::vector<POLE::Stream*> streams;
+  std::vector<std::vector<unsigned char> > buffers;
+  std::vector<std::future<POLE::uint64> > pending;
+  std::list<std::string>::iterator it;
+  for( it = names.begin(); it != names.end(); ++it )
+  {
+    POLE::Stream* stream = new POLE::Stream( &storage, *it );
+    streams.push_back( stream );
+    buffers.push_back( std::vector<unsigned char>( stream->size() + 1 ) );
+    pending.push_back( stream->readAsync( 0, &buffers.back()[0], stream->size() ) );
+  }
+
+  POLE::uint64 bytes = 0;
+  unsigned failed = 0;
+  for( unsigned i = 0; i < streams.size(); i++ )
+  {
+    POLE::uint64 read = pending[i].get();
+    if( read != streams[i]->size() )
+      failed++;
+    bytes += read;
+    delete streams[i];
+  }
+
+  double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  std::cout << streams.size() << " streams, " << bytes << " bytes read in " << seconds << " s" << std::endl;
+  if( failed )
+    std::cout << failed << " streams could not be read completely" << std::endl;
+  return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if( argc < 2 || ( std::string( argv[1] ) == "-c" && argc < 3 ) )
+  {
+    std::cout << "Usage:" << std::endl;
+    std::cout << argv[0] << " filename" << std::endl;
+    std::cout << argv[0] << " -c filename [count]" << std::endl;
+    std::cout << "Reads all streams of the file at once; with -c, the file is first" << std::endl;
+    std::cout << "created with count streams (1000 by default)." << std::endl;
+    return 0;
+  }
+
+  if( std::string( argv[1] ) == "-c" )
+  {
+    unsigned count = ( argc > 3 ) ? atoi( argv[3] ) : 1000;
+    if( !create( argv[2], count ) )
+    {
+      std::cout << "Error creating " << argv[2] << std::endl;
+      return 1;
+    }
+    return readAll( argv[2] );
+  }
+  return readAll( argv[1] );
+}
@@ -0,0 +1,462 @@
+/* POLE - Portable library to access OLE Storage
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   * Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be
+     used to endorse or promote products derived from this software without
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Measures the hot paths of the library on files it creates itself, for a few
+// sector sizes, entry counts and stream sizes. Every result is one line of CSV
+// on standard output, the median of a few runs, so that the output of two
+// releases can be compared by a script. The files are in the page cache most
+// of the time, so this is about the library rather than the disk.
+
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <chrono>
+
+#include "pole.h"
+
+#define SMALLSTREAMSIZE 100 // bytes in each stream of the files with many entries
+#define STREAMSPERDIR 100 // streams in each directory of those files
+#define SEQCHUNK 65536 // bytes per call of sequential reads and writes
+#define RANDCHUNK 4096 // bytes per call of random reads and writes
+#define GETCHBYTES 4194304 // most bytes read with getch()
+#define OPENREPEAT 20 // times a file is opened to measure opening
+#define FLUSHREPEAT 50 // flushes measured, after a small change each
+
+using POLE::uint64;
+
+// what one run of a benchmark did, and how long it took
+struct Result
+{
+  uint64 ops;
+  uint64 bytes;
+  double seconds;
+};
+
+// the parameters of a benchmark, reported with its results
+struct Params
+{
+  unsigned sectorSize;
+  uint64 entries;
+  uint64 streamSize;
+};
+
+typedef std::function<Result( const Params& )> Bench;
+
+static std::string workdir = ".";
+static std::string filter;
+static int repeat = 3;
+
+class Timer
+{
+  public:
+    Timer(): start( std::chrono::steady_clock::now() ) {}
+    double seconds() const
+    {
+      return std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    }
+  private:
+    std::chrono::steady_clock::time_point start;
+};
+
+static std::string fileName( const char* what )
+{
+  return workdir + "/polebench-" + what + ".ole";
+}
+
+static int openFlags( const Params& p )
+{
+  return ( p.sectorSize > 512 ) ? POLE::Storage::LargeSectors : 0;
+}
+
+static std::string streamName( uint64 i )
+{
+  char name[64];
+  sprintf( name, "/dir%llu/stream%llu", (unsigned long long)( i / STREAMSPERDIR ), (unsigned long long) i );
+  return name;
+}
+
+// names of all streams of a file with many entries, in random but repeatable order
+static std::vector<std::string> shuffledNames( uint64 entries )
+{
+  std::vector<std::string> names;
+  for( uint64 i = 0; i < entries; i++ )
+    names.push_back( streamName( i ) );
+  std::mt19937 random( 1 );
+  std::shuffle( names.begin(), names.end(), random );
+  return names;
+}
+
+// a file with p.entries small streams, for the benchmarks which do not create one
+static void createEntries( const char* what, const Params& p )
+{
+  std::string filename = fileName( what );
+  remove( filename.c_str() );
+  POLE::Storage storage( filename.c_str() );
+  storage.open( true, true, openFlags( p ) );
+  std::vector<std::string> names;
+  for( uint64 i = 0; i < p.entries; i++ )
+    names.push_back( streamName( i ) );
+  storage.createStreams( names, std::vector<uint64>( names.size(), SMALLSTREAMSIZE ) );
+  unsigned char data[SMALLSTREAMSIZE];
+  memset( data, 'x', sizeof( data ) );
+  for( uint64 i = 0; i < p.entries; i++ )
+  {
+    POLE::Stream stream( &storage, names[i] );
+    stream.write( data, sizeof( data ) );
+  }
+  storage.close();
+}
+
+// a file with one stream of p.streamSize bytes
+static void createBig( const char* what, const Params& p )
+{
+  std::string filename = fileName( what );
+  remove( filename.c_str() );
+  POLE::Storage storage( filename.c_str() );
+  storage.open( true, true, openFlags( p ), p.streamSize );
+  POLE::Stream stream( &storage, "/big", true );
+  std::vector<unsigned char> data( SEQCHUNK, 'x' );
+  for( uint64 pos = 0; pos < p.streamSize; pos += SEQCHUNK )
+    stream.write( &data[0], std::min( (uint64) SEQCHUNK, p.streamSize - pos ) );
+  storage.close();
+}
+
+// ---------- many entries ----------
+
+static Result createStreams( const Params& p )
+{
+  std::string filename = fileName( "create" );
+  remove( filename.c_str() );
+  unsigned char data[SMALLSTREAMSIZE];
+  memset( data, 'x', sizeof( data ) );
+
+  Timer timer;
+  POLE::Storage storage( filename.c_str() );
+  storage.open( true, true, openFlags( p ) );
+  for( uint64 i = 0; i < p.entries; i++ )
+  {
+    POLE::Stream stream( &storage, streamName( i ), true );
+    stream.write( data, sizeof( data ) );
+  }
+  storage.close();
+  Result r = { p.entries, p.entries * SMALLSTREAMSIZE, timer.seconds() };
+  return r;
+}
+
+static Result createBatch( const Params& p )
+{
+  Timer timer;
+  createEntries( "create", p );
+  Result r = { p.entries, p.entries * SMALLSTREAMSIZE, timer.seconds() };
+  return r;
+}
+
+static Result openWith( const Params&, int flags )
+{
+  std::string filename = fileName( "entries" );
+  Timer timer;
+  for( int i = 0; i < OPENREPEAT; i++ )
+  {
+    POLE::Storage storage( filename.c_str() );
+    storage.open( false, false, flags );
+  }
+  Result r = { OPENREPEAT, 0, timer.seconds() };
+  return r;
+}
+
+static Result openPlain( const Params& p ) { return openWith( p, 0 ); }
+static Result openLazy( const Params& p ) { return openWith( p, POLE::Storage::LazyDirectory ); }
+static Result openParallel( const Params& p ) { return openWith( p, POLE::Storage::ParallelLoad ); }
+
+static Result lookup( const Params& p )
+{
+  std::vector<std::string> names = shuffledNames( p.entries );
+  POLE::Storage storage( fileName( "entries" ).c_str() );
+  storage.open();
+
+  Timer timer;
+  uint64 found = 0;
+  for( uint64 i = 0; i < names.size(); i++ )
+    found += storage.exists( names[i] );
+  Result r = { found, 0, timer.seconds() };
+  return r;
+}
+
+static Result enumerate( const Params& )
+{
+  POLE::Storage storage( fileName( "entries" ).c_str() );
+  storage.open();
+
+  Timer timer;
+  uint64 count = 0;
+  std::list<std::string> dirs = storage.entries( "/" );
+  std::list<std::string>::iterator it;
+  for( it = dirs.begin(); it != dirs.end(); ++it )
+    count += 1 + storage.entries( "/" + *it ).size();
+  Result r = { count, 0, timer.seconds() };
+  return r;
+}
+
+static Result readSmall( const Params& p )
+{
+  std::vector<std::string> names = shuffledNames( p.entries );
+  POLE::Storage storage( fileName( "entries" ).c_str() );
+  storage.open();
+  unsigned char data[SMALLSTREAMSIZE];
+
+  Timer timer;
+  uint64 bytes = 0;
+  for( uint64 i = 0; i < names.size(); i++ )
+  {
+    POLE::Stream stream( &storage, names[i] );
+    bytes += stream.read( data, sizeof( data ) );
+  }
+  Result r = { names.size(), bytes, timer.seconds() };
+  return r;
+}
+
+static Result flush( const Params& p )
+{
+  std::vector<std::string> names = shuffledNames( p.entries );
+  POLE::Storage storage( fileName( "entries" ).c_str() );
+  storage.open( true );
+  unsigned char data[SMALLSTREAMSIZE];
+  memset( data, 'y', sizeof( data ) );
+
+  Timer timer;
+  for( int i = 0; i < FLUSHREPEAT; i++ )
+  {
+    POLE::Stream stream( &storage, names[i % names.size()] );
+    stream.write( data, sizeof( data ) );
+    stream.flush();
+  }
+  double seconds = timer.seconds();
+  storage.close();
+  Result r = { FLUSHREPEAT, FLUSHREPEAT * SMALLSTREAMSIZE, seconds };
+  return r;
+}
+
+static Result deleteHalf( const Params& p )
+{
+  createEntries( "delete", p );
+  std::vector<std::string> names = shuffledNames( p.entries );
+  names.resize( names.size() / 2 );
+
+  Timer timer;
+  POLE::Storage storage( fileName( "delete" ).c_str() );
+  storage.open( true );
+  for( uint64 i = 0; i < names.size(); i++ )
+    storage.deleteByName( names[i] );
+  storage.close();
+  Result r = { names.size(), 0, timer.seconds() };
+  return r;
+}
+
+// ---------- one big stream ----------
+
+static Result writeSequential( const Params& p )
+{
+  Timer timer;
+  createBig( "big", p );
+  Result r = { ( p.streamSize + SEQCHUNK - 1 ) / SEQCHUNK, p.streamSize, timer.seconds() };
+  return r;
+}
+
+// offsets of random reads and writes, the same for every run
+static std::vector<uint64> randomOffsets( const Params& p )
+{
+  std::vector<uint64> offsets( p.streamSize / RANDCHUNK / 4 + 1 );
+  std::mt19937 random( 1 );
+  for( uint64 i = 0; i < offsets.size(); i++ )
+    offsets[i] = ( random() % ( p.streamSize / RANDCHUNK ) ) * RANDCHUNK;
+  return offsets;
+}
+
+static Result writeRandom( const Params& p )
+{
+  std::vector<uint64> offsets = randomOffsets( p );
+  std::vector<unsigned char> data( RANDCHUNK, 'y' );
+
+  Timer timer;
+  POLE::Storage storage( fileName( "big" ).c_str() );
+  storage.open( true );
+  POLE::Stream stream( &storage, "/big" );
+  for( uint64 i = 0; i < offsets.size(); i++ )
+  {
+    stream.seek( offsets[i] );
+    stream.write( &data[0], RANDCHUNK );
+  }
+  storage.close();
+  Result r = { offsets.size(), offsets.size() * RANDCHUNK, timer.seconds() };
+  return r;
+}
+
+static Result readSequential( const Params& )
+{
+  std::vector<unsigned char> data( SEQCHUNK );
+
+  Timer timer;
+  POLE::Storage storage( fileName( "big" ).c_str() );
+  storage.open();
+  POLE::Stream stream( &storage, "/big" );
+  uint64 ops = 0, bytes = 0, got;
+  while( ( got = stream.read( &data[0], SEQCHUNK ) ) > 0 )
+  {
+    ops++;
+    bytes += got;
+  }
+  Result r = { ops, bytes, timer.seconds() };
+  return r;
+}
+
+static Result readRandom( const Params& p )
+{
+  std::vector<uint64> offsets = randomOffsets( p );
+  std::vector<unsigned char> data( RANDCHUNK );
+  POLE::Storage storage( fileName( "big" ).c_str() );
+  storage.open();
+  POLE::Stream stream( &storage, "/big" );
+
+  Timer timer;
+  uint64 bytes = 0;
+  for( uint64 i = 0; i < offsets.size(); i++ )
+  {
+    stream.seek( offsets[i] );
+    bytes += stream.read( &data[0], RANDCHUNK );
+  }
+  Result r = { offsets.size(), bytes, timer.seconds() };
+  return r;
+}
+
+static Result getch( const Params& p )
+{
+  POLE::Storage storage( fileName( "big" ).c_str() );
+  storage.open();
+  POLE::Stream stream( &storage, "/big" );
+  uint64 count = std::min( p.streamSize, (uint64) GETCHBYTES );
+
+  Timer timer;
+  uint64 bytes = 0;
+  for( uint64 i = 0; i < count; i++ )
+    if( stream.getch() >= 0 )
+      bytes++;
+  Result r = { count, bytes, timer.seconds() };
+  return r;
+}
+
+// runs a benchmark a few times and prints the median run
+static void run( const char* name, const Params& p, const Bench& bench )
+{
+  if( !filter.empty() && std::string( name ).find( filter ) == std::string::npos )
+    return;
+  std::vector<Result> results;
+  for( int i = 0; i < repeat; i++ )
+    results.push_back( bench( p ) );
+  std::sort( results.begin(), results.end(),
+    []( const Result& a, const Result& b ) { return a.seconds < b.seconds; } );
+  Result r = results[ results.size() / 2 ];
+  double seconds = ( r.seconds > 0 ) ? r.seconds : 1e-9;
+  printf( "%s,%u,%llu,%llu,%llu,%llu,%.6f,%.1f,%.2f\n", name, p.sectorSize,
+    (unsigned long long) p.entries, (unsigned long long) p.streamSize,
+    (unsigned long long) r.ops, (unsigned long long) r.bytes, r.seconds,
+    r.ops / seconds, r.bytes / seconds / 1048576 );
+  fflush( stdout );
+}
+
+int main(int argc, char *argv[])
+{
+  int scale = 1;
+  for( int arg = 1; arg < argc; arg += 2 )
+  {
+    std::string option = argv[arg];
+    if( arg + 1 >= argc )
+      option = "-h";
+    if( option == "-d" )
+      workdir = argv[arg+1];
+    else if( option == "-f" )
+      filter = argv[arg+1];
+    else if( option == "-r" )
+      repeat = atoi( argv[arg+1] );
+    else if( option == "-s" )
+      scale = atoi( argv[arg+1] );
+    else
+    {
+      std::cout << "Usage:" << std::endl;
+      std::cout << argv[0] << " [-d work-dir] [-f name-filter] [-r runs] [-s scale]" << std::endl;
+      std::cout << "Prints one CSV line per benchmark; scale multiplies entry counts and stream sizes." << std::endl;
+      return 0;
+    }
+  }
+  if( repeat < 1 ) repeat = 1;
+  if( scale < 1 ) scale = 1;
+
+  printf( "benchmark,sector_size,entries,stream_size,ops,bytes,seconds,ops_per_sec,mb_per_sec\n" );
+
+  const unsigned sectorSizes[] = { 512, 4096 };
+  const uint64 entryCounts[] = { 1000, 20000 };
+  const uint64 streamSizes[] = { 1048576, 67108864 };
+  for( unsigned s = 0; s < 2; s++ )
+  {
+    for( unsigned e = 0; e < 2; e++ )
+    {
+      Params p = { sectorSizes[s], entryCounts[e] * scale, SMALLSTREAMSIZE };
+      run( "create_streams", p, createStreams );
+      run( "create_batch", p, createBatch );
+      createEntries( "entries", p );
+      run( "open", p, openPlain );
+      run( "open_lazy", p, openLazy );
+      run( "open_parallel", p, openParallel );
+      run( "lookup", p, lookup );
+      run( "enumerate", p, enumerate );
+      run( "read_small", p, readSmall );
+      run( "flush", p, flush );
+      run( "delete", p, deleteHalf );
+    }
+    for( unsigned z = 0; z < 2; z++ )
+    {
+      Params p = { sectorSizes[s], 1, streamSizes[z] * scale };
+      run( "write_seq", p, writeSequential );
+      createBig( "big", p );
+      run( "write_rand", p, writeRandom );
+      run( "read_seq", p, readSequential );
+      run( "read_rand", p, readRandom );
+      run( "getch", p, getch );
+    }
+  }
+
+  const char* files[] = { "create", "entries", "delete", "big" };
+  for( unsigned i = 0; i < 4; i++ )
+    remove( fileName( files[i] ).c_str() );
+  return 0;
+}
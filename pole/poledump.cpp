@@ -30,11 +30,26 @@
 #include <fstream>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <list>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <chrono>
 
 #include "pole.h"
 
+#ifdef POLE_WIN
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#define EXTRACTBUFSIZE 1048576 // bytes read from a stream at a time
+
 void visit( int indent, POLE::Storage* storage, std::string path )
 {
   std::list<std::string> entries;
@@ -65,17 +80,22 @@ void dump( POLE::Storage* storage, char* stream_name )
   if( stream->fail() ) return;
   
   // std::cout << "Size: " << stream->size() << " bytes" << std::endl;
-  unsigned char buffer[16];
+  std::vector<unsigned char> data( 65536 );
   for( ;; )
   {
-      unsigned read = stream->read( buffer, sizeof( buffer ) );
+    unsigned got = (unsigned) stream->read( &data[0], data.size() );
+    for( unsigned line = 0; line < got || line == 0; line += 16 )
+    {
+      unsigned char* buffer = &data[line];
+      unsigned read = ( got - line < 16 ) ? got - line : 16;
       for( unsigned i = 0; i < read; i++ )
         printf( "%02x ", buffer[i] );
       std::cout << "    ";
       for( unsigned i = 0; i < read; i++ )
         printf( "%c", ((buffer[i]>=32)&&(buffer[i]<128)) ? buffer[i] : '.' );
       std::cout << std::endl;      
-      if( read < sizeof( buffer ) ) break;
+    }
+    if( got < data.size() ) break;
   }
   
   delete stream;
@@ -90,30 +110,195 @@ void extract( POLE::Storage* storage, char* stream_name, char* outfile )
   std::ofstream file;
   file.open( outfile, std::ios::binary|std::ios::out );
   
-  unsigned char buffer[16];
+  std::vector<unsigned char> buffer( EXTRACTBUFSIZE );
   for( ;; )
   {
-      unsigned read = stream->read( buffer, sizeof( buffer ) );
-      file.write( (const char*)buffer, read  );
-      if( read < sizeof( buffer ) ) break;
+      POLE::uint64 read = stream->read( &buffer[0], buffer.size() );
+      file.write( (const char*)&buffer[0], read  );
+      if( read < buffer.size() ) break;
   }
   file.close();
   
   delete stream;
 }
 
+// a stream to be written to a host file by extractAll
+struct Job
+{
+  POLE::EntryHandle handle;
+  std::string outfile;
+  POLE::uint64 size;
+  POLE::uint64 offset;
+};
+
+static bool byOffset( const Job& a, const Job& b )
+{
+  return a.offset < b.offset;
+}
+
+// makes a name of an entry usable as a file name on the host
+static std::string hostName( const std::string& name )
+{
+  std::string result = name;
+  for( unsigned i = 0; i < result.size(); i++ )
+  {
+    unsigned char c = result[i];
+    if( c < 32 || strchr( "/\\:*?\"<>|", c ) )
+      result[i] = '_';
+  }
+  if( result == "." || result == ".." )
+    result = "_" + result;
+  return result;
+}
+
+static bool makeDir( const std::string& path )
+{
+#ifdef POLE_USE_UTF16_FILENAMES
+  int rc = _wmkdir( POLE::UTF8toUTF16( path ).c_str() );
+#elif defined POLE_WIN
+  int rc = _mkdir( path.c_str() );
+#else
+  int rc = mkdir( path.c_str(), 0777 );
+#endif
+  return rc == 0 || errno == EEXIST;
+}
+
+static FILE* createFile( const std::string& path )
+{
+#ifdef POLE_USE_UTF16_FILENAMES
+  return _wfopen( POLE::UTF8toUTF16( path ).c_str(), L"wb" );
+#else
+  return fopen( path.c_str(), "wb" );
+#endif
+}
+
+// creates the host directories below outdir and lists the streams of dir
+static void collect( POLE::Storage* storage, const POLE::EntryHandle& dir,
+  const std::string& outdir, std::vector<Job>& jobs )
+{
+  std::vector<POLE::EntryHandle> children = storage->children( dir );
+  for( unsigned i = 0; i < children.size(); i++ )
+  {
+    POLE::EntryInfo info;
+    if( !storage->stat( children[i], info ) ) continue;
+    std::string path = outdir + "/" + hostName( info.name );
+    if( info.isDirectory )
+    {
+      makeDir( path );
+      collect( storage, children[i], path, jobs );
+    }
+    else
+    {
+      Job job;
+      job.handle = children[i];
+      job.outfile = path;
+      job.size = info.size;
+      job.offset = info.offset;
+      jobs.push_back( job );
+    }
+  }
+}
+
+// worker of extractAll, takes the next stream in the list until none is left
+static void extractJobs( POLE::Storage* storage, const std::vector<Job>* jobs,
+  std::atomic<size_t>* next, std::atomic<int>* failed )
+{
+  std::vector<unsigned char> buffer( EXTRACTBUFSIZE );
+  for( ;; )
+  {
+    size_t idx = (*next)++;
+    if( idx >= jobs->size() ) break;
+    const Job& job = (*jobs)[idx];
+    POLE::Stream stream( storage, job.handle );
+    FILE* file = stream.fail() ? 0 : createFile( job.outfile );
+    if( !file )
+    {
+      std::cerr << "Can't extract to " << job.outfile << std::endl;
+      (*failed)++;
+      continue;
+    }
+    setvbuf( file, 0, _IONBF, 0 ); // whole buffers are written at a time anyway
+    POLE::uint64 total = 0;
+    for( ;; )
+    {
+      POLE::uint64 read = stream.read( &buffer[0], buffer.size() );
+      if( read > 0 && fwrite( &buffer[0], 1, read, file ) != read ) break;
+      total += read;
+      if( read < buffer.size() ) break;
+    }
+    if( fclose( file ) != 0 || total != job.size )
+    {
+      std::cerr << "Can't extract to " << job.outfile << std::endl;
+      (*failed)++;
+    }
+  }
+}
+
+// Extracts every stream into a file below outdir, using nthreads threads. The
+// streams are handed out in the order of their data in the file, so that the
+// reads of all threads together mostly move forward through the file.
+int extractAll( POLE::Storage* storage, const char* outdir, int nthreads )
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  std::vector<Job> jobs;
+  makeDir( outdir );
+  collect( storage, storage->handle( "/" ), outdir, jobs );
+  std::stable_sort( jobs.begin(), jobs.end(), byOffset );
+
+  std::atomic<size_t> next( 0 );
+  std::atomic<int> failed( 0 );
+  std::vector<std::thread> workers;
+  for( int i = 0; i < nthreads; i++ )
+    workers.push_back( std::thread( extractJobs, storage, &jobs, &next, &failed ) );
+  for( unsigned i = 0; i < workers.size(); i++ )
+    workers[i].join();
+
+  double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  POLE::uint64 bytes = 0;
+  for( unsigned i = 0; i < jobs.size(); i++ )
+    bytes += jobs[i].size;
+  std::cout << jobs.size() << " streams, " << bytes << " bytes in " << seconds << " s";
+  if( seconds > 0 )
+    std::cout << " (" << bytes / seconds / 1048576 << " MB/s)";
+  std::cout << std::endl;
+  POLE::IoStats stats = storage->ioStats();
+  std::cout << stats.reads << " reads, " << stats.seeks << " seeks, read amplification "
+    << stats.readAmplification() << std::endl;
+  if( failed > 0 )
+    std::cout << failed << " streams could not be extracted" << std::endl;
+  return failed > 0 ? 1 : 0;
+}
+
 int main(int argc, char *argv[])
 {
-  if( argc < 2 )
+  // options come first
+  char* outdir = 0;
+  int nthreads = 1;
+  int arg = 1;
+  while( arg + 1 < argc && argv[arg][0] == '-' )
+  {
+    std::string option = argv[arg];
+    if( option == "-x" )
+      outdir = argv[arg+1];
+    else if( option == "-j" )
+      nthreads = atoi( argv[arg+1] );
+    else
+      break;
+    arg += 2;
+  }
+
+  if( argc - arg < 1 || nthreads < 1 )
   {
     std::cout << "Usage:" << std::endl;
     std::cout << argv[0] << " filename [stream-name [output-file]]" << std::endl;
+    std::cout << argv[0] << " -x output-dir [-j threads] filename" << std::endl;
     return 0;
   }
   
-  char* filename = argv[1];
-  char* streamname = (argc<3) ? 0 : argv[2];
-  char* outfile = (argc<4) ? 0 : argv[3];
+  char* filename = argv[arg];
+  char* streamname = (argc<arg+2) ? 0 : argv[arg+1];
+  char* outfile = (argc<arg+3) ? 0 : argv[arg+2];
 
   POLE::Storage* storage = new POLE::Storage( filename );
   storage->open();
@@ -123,6 +308,13 @@ int main(int argc, char *argv[])
     return 1;
   }
   
+  if( outdir )
+  {
+    int rc = extractAll( storage, outdir, nthreads );
+    delete storage;
+    return rc;
+  }
+
   if( !streamname )
     visit( 0, storage, "/" );
   else if( !outfile )
@@ -0,0 +1,332 @@
+/* POLE - Portable library to access OLE Storage
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions
+   are met:
+   * Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+   * Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+   * Neither the name of the authors nor the names of its contributors may be
+     used to endorse or promote products derived from this software without
+     specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+   AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+   IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+   ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+   LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+   CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+   SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+   INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+   CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+   ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF
+   THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// Generates compound files for benchmarks and stress tests, so that large inputs
+// need not be shipped. The same seed and parameters always give the same file.
+// Everything is written through the library, as an application would.
+
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <chrono>
+
+#include "pole.h"
+
+#define WRITECHUNK 1048576 // most bytes written at a time
+#define MINISIZE 4096 // streams below this size are kept in the mini stream
+
+using POLE::uint64;
+
+enum { Sorted, Reverse, Random };
+
+struct Config
+{
+  uint64 seed;
+  uint64 entries;        // streams, not counting the big one
+  unsigned depth;        // directories above each stream
+  unsigned fanout;       // subdirectories of each directory
+  int order;             // in which the streams are created
+  bool longNames;        // 31 characters, differing only at the end
+  unsigned miniPercent;  // streams below MINISIZE, in percent
+  uint64 maxSize;        // of the other streams
+  uint64 bigSize;        // of /big, 0 for none
+  uint64 fragment;       // sectors written to a stream at a time, round robin; 0 writes each at once
+  bool largeSectors;
+};
+
+// parameter sets for the usual cases, applied before the other options
+struct Preset
+{
+  const char* name;
+  const char* options;
+};
+
+static const Preset presets[] = {
+  { "many", "-entries 100000 -depth 2 -fanout 32 -order random -mini 90 -maxsize 64K" },
+  { "deep", "-entries 10000 -depth 16 -fanout 2 -maxsize 64K" },
+  { "wide", "-entries 100000 -depth 0 -order random -mini 90 -maxsize 16K" },
+  { "worst", "-entries 20000 -depth 0 -order sorted -names long -mini 100" },
+  { "fragmented", "-entries 200 -depth 0 -mini 0 -maxsize 1M -fragment 1" },
+  { "difat", "-entries 10 -depth 0 -big 3G" },
+  { "mini", "-entries 50000 -depth 1 -fanout 50 -mini 100" }
+};
+
+// a number, optionally followed by K, M or G
+static uint64 parseSize( const std::string& text )
+{
+  char* end = 0;
+  uint64 value = strtoull( text.c_str(), &end, 10 );
+  if( *end == 'K' || *end == 'k' ) value <<= 10;
+  else if( *end == 'M' || *end == 'm' ) value <<= 20;
+  else if( *end == 'G' || *end == 'g' ) value <<= 30;
+  return value;
+}
+
+// applies one option and its value, returns false if it is unknown
+static bool setOption( Config& config, const std::string& option, const std::string& value )
+{
+  if( option == "-seed" ) config.seed = parseSize( value );
+  else if( option == "-entries" ) config.entries = parseSize( value );
+  else if( option == "-depth" ) config.depth = atoi( value.c_str() );
+  else if( option == "-fanout" ) config.fanout = atoi( value.c_str() );
+  else if( option == "-order" )
+  {
+    if( value == "sorted" ) config.order = Sorted;
+    else if( value == "reverse" ) config.order = Reverse;
+    else if( value == "random" ) config.order = Random;
+    else return false;
+  }
+  else if( option == "-names" )
+  {
+    if( value != "short" && value != "long" ) return false;
+    config.longNames = ( value == "long" );
+  }
+  else if( option == "-mini" ) config.miniPercent = atoi( value.c_str() );
+  else if( option == "-maxsize" ) config.maxSize = parseSize( value );
+  else if( option == "-big" ) config.bigSize = parseSize( value );
+  else if( option == "-fragment" ) config.fragment = parseSize( value );
+  else if( option == "-sectors" ) config.largeSectors = ( value == "4096" );
+  else return false;
+  return true;
+}
+
+static bool applyPreset( Config& config, const std::string& name )
+{
+  for( unsigned i = 0; i < sizeof( presets ) / sizeof( presets[0] ); i++ )
+  {
+    if( name != presets[i].name ) continue;
+    std::vector<std::string> words;
+    std::string options = presets[i].options;
+    for( size_t pos = 0, end; pos < options.size(); pos = end + 1 )
+    {
+      end = options.find( ' ', pos );
+      if( end == std::string::npos ) end = options.size();
+      words.push_back( options.substr( pos, end - pos ) );
+    }
+    for( unsigned w = 0; w + 1 < words.size(); w += 2 )
+      setOption( config, words[w], words[w+1] );
+    return true;
+  }
+  return false;
+}
+
+// the content of stream index: bytes which depend on the seed and the index only
+static void fill( const Config& config, uint64 index, uint64 pos, unsigned char* data, uint64 len )
+{
+  for( uint64 i = 0; i < len; i++ )
+  {
+    uint64 x = ( config.seed * 0x9E3779B97F4A7C15ULL ) ^ ( index << 32 ) ^ ( ( pos + i ) >> 3 );
+    x ^= x >> 29;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 32;
+    data[i] = (unsigned char)( x >> ( ( ( pos + i ) & 7 ) * 8 ) );
+  }
+}
+
+// appends bytes pos .. pos+len-1 of stream index, opened by its handle
+static bool writePart( POLE::Storage& storage, const POLE::EntryHandle& h, const Config& config,
+  uint64 index, uint64 pos, uint64 len, std::vector<unsigned char>& buffer )
+{
+  POLE::Stream stream( &storage, h );
+  if( stream.fail() ) return false;
+  stream.seek( pos );
+  while( len > 0 )
+  {
+    uint64 count = std::min( len, (uint64) buffer.size() );
+    fill( config, index, pos, &buffer[0], count );
+    if( stream.write( &buffer[0], count ) != count ) return false;
+    pos += count;
+    len -= count;
+  }
+  return true;
+}
+
+int generate( const Config& config, const char* filename )
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::mt19937_64 random( config.seed );
+
+  // where the streams are and how large they get
+  std::vector<std::string> paths( config.entries );
+  std::vector<uint64> sizes( config.entries );
+  for( uint64 i = 0; i < config.entries; i++ )
+  {
+    std::string path;
+    char name[64];
+    for( unsigned level = 0; level < config.depth; level++ )
+    {
+      sprintf( name, "/dir%u", (unsigned)( random() % std::max( config.fanout, 1u ) ) );
+      path += name;
+    }
+    if( config.longNames )
+      sprintf( name, "/a_stream_with_long_name_%07llu", (unsigned long long) i );
+    else
+      sprintf( name, "/s%07llu", (unsigned long long) i );
+    paths[i] = path + name;
+
+    if( random() % 100 < config.miniPercent || config.maxSize <= MINISIZE )
+      sizes[i] = random() % std::min( config.maxSize + 1, (uint64) MINISIZE );
+    else
+    {
+      // as many small ones as large ones, whatever the maximum
+      double range = std::log( (double) config.maxSize / MINISIZE );
+      sizes[i] = (uint64)( MINISIZE * std::exp( range * ( random() % 1000000 ) / 1000000 ) );
+    }
+  }
+
+  // the order of creation decides the shape of the sibling trees: names which all
+  // have the same length, created in order, make them as deep as they can get
+  std::vector<uint64> order( config.entries );
+  for( uint64 i = 0; i < config.entries; i++ )
+    order[i] = ( config.order == Reverse ) ? config.entries - 1 - i : i;
+  if( config.order == Random )
+    std::shuffle( order.begin(), order.end(), random );
+
+  remove( filename );
+  POLE::Storage storage( filename );
+  if( !storage.open( true, true, config.largeSectors ? POLE::Storage::LargeSectors : 0, config.bigSize ) )
+  {
+    std::cerr << "Can't create " << filename << std::endl;
+    return 1;
+  }
+
+  std::vector<POLE::EntryHandle> handles( config.entries );
+  if( config.order == Random )
+  {
+    // balanced trees anyway, so all at once
+    std::vector<std::string> names( config.entries );
+    for( uint64 i = 0; i < config.entries; i++ )
+      names[i] = paths[order[i]];
+    storage.createStreams( names );
+  }
+  else
+  {
+    for( uint64 i = 0; i < config.entries; i++ )
+      POLE::Stream stream( &storage, paths[order[i]], true );
+  }
+  for( uint64 i = 0; i < config.entries; i++ )
+    handles[i] = storage.handle( paths[i] );
+
+  // the data, either stream by stream, or a few sectors of each stream in turn so
+  // that their chains interleave
+  bool ok = true;
+  uint64 bytes = 0;
+  std::vector<unsigned char> buffer( WRITECHUNK );
+  uint64 sectorSize = config.largeSectors ? 4096 : 512;
+  uint64 chunk = config.fragment ? config.fragment * sectorSize : (uint64) -1;
+  std::vector<uint64> written( config.entries, 0 );
+  for( bool more = true; more && ok; )
+  {
+    more = false;
+    for( uint64 k = 0; k < config.entries && ok; k++ )
+    {
+      uint64 i = order[k];
+      uint64 len = std::min( sizes[i] - written[i], chunk );
+      if( len == 0 ) continue;
+      ok = writePart( storage, handles[i], config, i, written[i], len, buffer );
+      written[i] += len;
+      bytes += len;
+      more = more || written[i] < sizes[i];
+    }
+  }
+
+  if( ok && config.bigSize > 0 )
+  {
+    {
+      POLE::Stream stream( &storage, "/big", true );
+    }
+    ok = writePart( storage, storage.handle( "/big" ), config, config.entries, 0, config.bigSize, buffer );
+    bytes += config.bigSize;
+  }
+
+  storage.close();
+  if( !ok )
+  {
+    std::cerr << "Can't write " << filename << std::endl;
+    return 1;
+  }
+
+  double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+  std::cout << filename << ": " << config.entries + ( config.bigSize > 0 ) << " streams, "
+    << bytes << " bytes in " << seconds << " s" << std::endl;
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  Config config;
+  config.seed = 1;
+  config.entries = 1000;
+  config.depth = 1;
+  config.fanout = 10;
+  config.order = Sorted;
+  config.longNames = false;
+  config.miniPercent = 50;
+  config.maxSize = 1048576;
+  config.bigSize = 0;
+  config.fragment = 0;
+  config.largeSectors = false;
+
+  // a preset first, so that the other options change it
+  bool usage = ( argc < 2 ) || ( argc % 2 != 0 );
+  for( int arg = 1; arg + 1 < argc && !usage; arg += 2 )
+    if( std::string( argv[arg] ) == "-p" && !applyPreset( config, argv[arg+1] ) )
+      usage = true;
+  for( int arg = 1; arg + 1 < argc && !usage; arg += 2 )
+    if( std::string( argv[arg] ) != "-p" && !setOption( config, argv[arg], argv[arg+1] ) )
+      usage = true;
+
+  if( usage )
+  {
+    std::cout << "Usage:" << std::endl;
+    std::cout << argv[0] << " [-p preset] [options] filename" << std::endl;
+    std::cout << "Options, with their defaults:" << std::endl;
+    std::cout << "  -seed 1              the same seed and options give the same file" << std::endl;
+    std::cout << "  -entries 1000        number of streams" << std::endl;
+    std::cout << "  -depth 1             directories above each stream" << std::endl;
+    std::cout << "  -fanout 10           subdirectories of each directory" << std::endl;
+    std::cout << "  -order sorted        creation order: sorted, reverse or random" << std::endl;
+    std::cout << "  -names short         short or long (31 characters, differing at the end)" << std::endl;
+    std::cout << "  -mini 50             percentage of streams below 4096 bytes" << std::endl;
+    std::cout << "  -maxsize 1M          size of the largest other stream" << std::endl;
+    std::cout << "  -big 0               size of one more stream, /big" << std::endl;
+    std::cout << "  -fragment 0          write that many sectors of each stream in turn" << std::endl;
+    std::cout << "  -sectors 512         sector size, 512 or 4096" << std::endl;
+    std::cout << "Presets:" << std::endl;
+    for( unsigned i = 0; i < sizeof( presets ) / sizeof( presets[0] ); i++ )
+      std::cout << "  " << presets[i].name << ": " << presets[i].options << std::endl;
+    return 0;
+  }
+
+  return generate( config, argv[argc-1] );
+}
@@ -13,6 +13,7 @@ SOURCES += poleview.cpp
 
 CONFIG += qt
 CONFIG += thread 
+CONFIG += c++11
 CONFIG += warn_on
 CONFIG += exceptions
 CONFIG += release
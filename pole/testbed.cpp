@@ -189,71 +189,6 @@ bool AddFile2Storage(POLE::Storage* storage, std::string inFile, std::string nam
 	return true;
 }
 
-void AddDir2Storage(POLE::Storage* storage, std::string inDir, std::string name, int &nFolders, int &nFiles)
-{
-	WIN32_FIND_DATA ffd;
-	HANDLE h;
-
-
-	std::string inDirLcl = inDir + "*";
-	std::string outNameLcl = name;
-
-	const char *cInDir = inDirLcl.c_str();
-	h = FindFirstFile(cInDir, &ffd);
-	if (h == INVALID_HANDLE_VALUE)
-		return;
-	nFolders++;
-	do
-	{
-		if (ffd.cFileName[0] == '.')
-		{
-			if (ffd.cFileName[1] == 0 || (ffd.cFileName[1] == '.' && ffd.cFileName[2] == 0))
-				continue;
-		}
-		outNameLcl = name + ffd.cFileName;
-		if (ffd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-		{
-			outNameLcl += "/";
-			inDirLcl = inDir + ffd.cFileName;
-			inDirLcl += "\\";
-			AddDir2Storage(storage, inDirLcl, outNameLcl, nFolders, nFiles);
-		}
-		else
-		{
-			std::ifstream file;
-			std::string infname = inDir + ffd.cFileName;
-			const char *cinfname = infname.c_str();
-			file.open(cinfname, std::ios::binary|std::ios::in);
-			// find size of input file
-			file.seekg( 0, std::ios::end );
-			long filesize = file.tellg();
-			file.seekg( 0 );
-			POLE::Stream* ss = new POLE::Stream( storage, outNameLcl, true, filesize );
-			unsigned char buffer[4096];
-			int bytesRead = 0;
-			int bytesToRead;
-			for (;;)
-			{
-				bytesToRead = filesize - bytesRead;
-				if (bytesToRead <= 0)
-					break;
-				if (bytesToRead > 4096)
-					bytesToRead = 4096;
-				file.read((char *)buffer, bytesToRead);
-				ss->write(buffer, bytesToRead);
-				bytesRead += bytesToRead;
-			}
-			ss->flush();
-			delete ss;
-			file.close();
-			nFiles++;
-		}
-	}
-	while (FindNextFile(h, &ffd) != 0);
-}
-
-
-
 void cmdOpen(std::list<std::string> &entries)
 {
 	if (entries.size() < 1)
@@ -389,10 +324,10 @@ void cmdAdd(std::list<std::string> &entries)
 				ssPath = '/' + ssPath;
 			if (ssPath[ssPath.size()-1] != '/')
 				ssPath += '/';
-			int nFiles = 0;
-			int nFolders = 0;
-			AddDir2Storage(storage, filePath, ssPath, nFolders, nFiles);
-			printf("%d folders and %d files were added.\n", nFolders, nFiles);
+			if (storage->importTree(filePath, ssPath))
+				std::cout << "Ok" << std::endl;
+			else
+				std::cout << "Some files could not be added." << std::endl;
 		}
 		else
 		{
@@ -538,7 +473,7 @@ close
 		indir += "\\";
 	POLE::Storage* storage = new POLE::Storage(outfile);
 	storage->open(true, true);
-	AddDir2Storage(storage, indir, "/");
+	storage->importTree(indir, "/");
 	storage->close();
 	storage->open();
 	visit(0, storage, "/");